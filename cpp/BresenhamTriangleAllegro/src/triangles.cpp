@@ -6,6 +6,11 @@ using namespace std;
 
 // Use mathematics routines
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
 
 // Include Allegro headers.
 #include <allegro5/allegro.h>
@@ -13,11 +18,26 @@ using namespace std;
 #include <allegro5/allegro_color.h>
 
 // Include for threading
-#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// SIMD intrinsics for the span writer and the half-space rasterizer
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
 // ---------------------------- Global variables -------------------------- //
 ALLEGRO_DISPLAY*    display;
 ALLEGRO_EVENT_QUEUE* event_queue;
 ALLEGRO_EVENT       event;
+double              max_fps = 0;    // Redraws per second for animated content, 0 redraws only when needed
 
 // ---------------------------- Vector3f class -------------------------- //
 /**
@@ -69,6 +89,360 @@ struct vector3f {
     }
 };
 
+// ---------------------------- Rasterizer statistics -------------------------- //
+// Compiled with RASTER_STATS defined, the rasterizers count their work into stats: pixels and
+// spans written, triangles dropped before drawing a pixel, and how often every pixel was written,
+// which write_overdraw_ppm turns into a heatmap. Without it the STAT_ macros are empty, their
+// arguments are not even evaluated, and none of this is compiled in.
+
+#ifdef RASTER_STATS
+/**
+ * The totals are atomic since the tiled renderer draws on several threads. The per-pixel counts
+ * need not be, every pixel belongs to a single tile.
+ */
+struct raster_stats {
+    atomic<long long> pixels{0}, spans{0}, spanPixels{0}, culled{0};
+    int width = 0, height = 0;
+    vector<uint32_t> writes;    // Per pixel, rows packed one after another
+
+    // Clears the counters and tracks the writes on a width x height target
+    void reset(int w, int h) {
+        pixels = spans = spanPixels = culled = 0;
+        width = w;
+        height = h;
+        writes.assign(w * h, 0);
+    }
+    void pixel(int x, int y) {
+        pixels++;
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) writes[y * width + x]++;
+    }
+    // The pixels x + i of row y for the set bits i of mask, as a block row writes them
+    void block_row(int x, int y, int mask) {
+        for (; mask; mask &= mask - 1) pixel(x + __builtin_ctz(mask), y);
+    }
+    void hspan(int x, int y, int length) {
+        if (length <= 0) return;
+        spans++;
+        spanPixels += length;
+        pixels += length;
+        if ((unsigned)y >= (unsigned)height) return;
+        for (int from = max(x, 0), to = min(x + length, width); from < to; from++) writes[y * width + from]++;
+    }
+
+    void print(FILE* out) const {
+        long long touched = 0;
+        uint32_t most = 0;
+        for (size_t i = 0; i < writes.size(); i++) {
+            if (writes[i]) touched++;
+            most = max(most, writes[i]);
+        }
+        fprintf(out, "%lld pixels written, %lld spans of %.1f pixels on average, %lld triangles culled\n",
+                (long long)pixels, (long long)spans, spans ? spanPixels / (double)spans : 0.0, (long long)culled);
+        fprintf(out, "%lld pixels on the target drawn %.2f times on average, at most %u times\n",
+                touched, touched ? (double)pixels / touched : 0.0, most);
+    }
+};
+raster_stats stats;
+
+/**
+ * Writes the per-pixel counts as a binary PPM: black where nothing was drawn, blue, green, yellow
+ * and red for one to four writes, white for more.
+ */
+bool write_overdraw_ppm(const char* file) {
+    static const unsigned char ramp[6][3] = {{0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}, {255, 255, 255}};
+    FILE* f = fopen(file, "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%d %d\n255\n", stats.width, stats.height);
+    for (size_t i = 0; i < stats.writes.size(); i++) fwrite(ramp[min(stats.writes[i], 5u)], 3, 1, f);
+    fclose(f);
+    return true;
+}
+
+#define STAT_BLOCK_ROW(x, y, mask)  stats.block_row(x, y, mask)
+#define STAT_HSPAN(x, y, length)    stats.hspan(x, y, length)
+#define STAT_CULLED()               stats.culled++
+#else
+#define STAT_BLOCK_ROW(x, y, mask)
+#define STAT_HSPAN(x, y, length)
+#define STAT_CULLED()
+#endif
+
+// ---------------------------- Pixel sinks -------------------------- //
+// The rasterizers are templates over where their pixels go, so the same code draws to the
+// display, into a locked bitmap or into plain memory without an Allegro display at all.
+// A pixel sink provides:
+//   typedef ... color;                   - the color type it writes
+//   color map(vector3f v);               - converts an interpolated color to that type
+//   color map_packed(uint32_t c);        - same for a packed 0xAABBGGRR color
+//   void put(int x, int y, color c);     - writes a pixel
+// All three are defined in the class body, so every instantiation gets its write path inlined.
+// Memory sinks also have width, height and
+//   uint32_t* row(int y);                - the first pixel of row y
+// for the rasterizers that write whole rows of a block at once.
+
+// Memory sinks use packed 0xAABBGGRR pixels, i.e. ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE
+inline uint32_t pack_color(vector3f v) {
+    uint32_t r = (uint32_t)(min(1.0f, max(0.0f, v.x)) * 255 + 0.5f);
+    uint32_t g = (uint32_t)(min(1.0f, max(0.0f, v.y)) * 255 + 0.5f);
+    uint32_t b = (uint32_t)(min(1.0f, max(0.0f, v.z)) * 255 + 0.5f);
+    return r | (g << 8) | (b << 16) | 0xFF000000;
+}
+
+/**
+ * Draws through Allegro one pixel at a time, like the original exercise code.
+ */
+struct allegro_sink {
+    typedef ALLEGRO_COLOR color;
+
+    ALLEGRO_COLOR map(vector3f v) {
+        return v.as_color();
+    }
+    ALLEGRO_COLOR map_packed(uint32_t c) {
+        return al_map_rgb(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF);
+    }
+    void put(int x, int y, ALLEGRO_COLOR c) {
+        al_put_pixel(x, y, c);
+    }
+};
+
+/**
+ * A plain RGBA framebuffer in memory, one uint32_t per pixel, rows packed one after another.
+ * Pixels outside of it are dropped, as al_put_pixel would.
+ */
+struct framebuffer_sink {
+    typedef uint32_t color;
+    uint32_t* pixels;
+    int width, height;
+
+    framebuffer_sink(uint32_t* pixels, int width, int height): pixels(pixels), width(width), height(height) {};
+
+    uint32_t map(vector3f v) {
+        return pack_color(v);
+    }
+    uint32_t map_packed(uint32_t c) {
+        return c;
+    }
+    void put(int x, int y, uint32_t c) {
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) pixels[y * width + x] = c;
+    }
+    uint32_t* row(int y) {
+        return pixels + y * width;
+    }
+};
+
+/**
+ * Writes into the memory of the locked target bitmap.
+ */
+struct locked_bitmap_sink {
+    typedef uint32_t color;
+    ALLEGRO_BITMAP* bitmap;
+    unsigned char* data;
+    int pitch;          // Bytes between rows, may be negative
+    int width, height;
+
+    /**
+     * Locks the whole target bitmap. Returns false if it could not be locked.
+     */
+    bool lock() {
+        bitmap = al_get_target_bitmap();
+        ALLEGRO_LOCKED_REGION* region = al_lock_bitmap(bitmap, ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READWRITE);
+        if (region == NULL) return false;
+        data = (unsigned char*)region->data;
+        pitch = region->pitch;
+        width = al_get_bitmap_width(bitmap);
+        height = al_get_bitmap_height(bitmap);
+        return true;
+    }
+    void unlock() {
+        al_unlock_bitmap(bitmap);
+    }
+
+    uint32_t map(vector3f v) {
+        return pack_color(v);
+    }
+    uint32_t map_packed(uint32_t c) {
+        return c;
+    }
+    void put(int x, int y, uint32_t c) {
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) ((uint32_t*)(data + y * pitch))[x] = c;
+    }
+    uint32_t* row(int y) {
+        return (uint32_t*)(data + y * pitch);
+    }
+};
+
+/**
+ * A copy of the target bitmap in memory, for the rasterizers that need the memory of a sink when
+ * the target cannot be locked, e.g. because the caller already locked it. The copy is taken with
+ * al_get_pixel and store puts back the pixels that changed with al_put_pixel, so it is slow.
+ */
+struct copied_target_sink: framebuffer_sink {
+    vector<uint32_t> copy, original;
+
+    copied_target_sink(): framebuffer_sink(NULL, 0, 0) {
+        ALLEGRO_BITMAP* target = al_get_target_bitmap();
+        width = al_get_bitmap_width(target);
+        height = al_get_bitmap_height(target);
+        copy.resize(width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                unsigned char r, g, b;
+                al_unmap_rgb(al_get_pixel(target, x, y), &r, &g, &b);
+                copy[y * width + x] = r | (g << 8) | (b << 16) | 0xFF000000;
+            }
+        }
+        original = copy;
+        pixels = copy.data();
+    }
+
+    void store() {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint32_t c = copy[y * width + x];
+                if (c != original[y * width + x]) al_put_pixel(x, y, al_map_rgb(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF));
+            }
+        }
+    }
+};
+
+/**
+ * Only counts the pixels, so that pure rasterization cost can be measured.
+ */
+struct counting_sink {
+    typedef uint32_t color;
+    long long pixels;
+
+    counting_sink(): pixels(0) {};
+
+    uint32_t map(vector3f) {
+        return 0;
+    }
+    uint32_t map_packed(uint32_t) {
+        return 0;
+    }
+    void put(int, int, uint32_t) {
+        pixels++;
+    }
+};
+
+/**
+ * Rectangle of pixels, both corners inclusive. The rasterizers only write pixels inside it.
+ */
+struct clip_rect {
+    int x0, y0, x1, y1;
+};
+const clip_rect NO_CLIP = {-(1 << 30), -(1 << 30), 1 << 30, 1 << 30};
+
+// ---------------------------- Span writer -------------------------- //
+// Gouraud spans go straight into the memory of memory sinks. Each color channel comes in as a
+// 16.16 fixed-point number over 0..255, with the rounding offset already added, and a step per
+// pixel. The vector loop keeps the channels of several pixels in 32-bit lanes and steps them by
+// whole multiples of the step, so every pixel gets exactly the channels the scalar loop would
+// give it, wherever the span starts. Saturating packs then clamp them to 0..255 and a shuffle
+// interleaves them into 0xAABBGGRR pixels.
+
+inline uint32_t span_pixel(int32_t r, int32_t g, int32_t b) {
+    return 0xFF000000 | min(255, max(0, r >> 16)) | min(255, max(0, g >> 16)) << 8 | min(255, max(0, b >> 16)) << 16;
+}
+
+#if defined(__AVX2__)
+// Eight pixels from their 16.16 channels; the packs work within 128-bit halves, which hold pixels 0-3 and 4-7
+inline __m256i span_pixels(__m256i r, __m256i g, __m256i b) {
+    __m256i rg = _mm256_packs_epi32(_mm256_srai_epi32(r, 16), _mm256_srai_epi32(g, 16));
+    __m256i ba = _mm256_packs_epi32(_mm256_srai_epi32(b, 16), _mm256_set1_epi32(255));
+    return _mm256_shuffle_epi8(_mm256_packus_epi16(rg, ba), _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                                                                             0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15));
+}
+#elif defined(__SSE4_1__)
+// Four pixels from their 16.16 channels
+inline __m128i span_pixels(__m128i r, __m128i g, __m128i b) {
+    __m128i rg = _mm_packs_epi32(_mm_srai_epi32(r, 16), _mm_srai_epi32(g, 16));
+    __m128i ba = _mm_packs_epi32(_mm_srai_epi32(b, 16), _mm_set1_epi32(255));
+    return _mm_shuffle_epi8(_mm_packus_epi16(rg, ba), _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15));
+}
+#endif
+
+/**
+ * Writes count pixels from p on, starting with channels r, g, b and adding dr, dg, db per pixel.
+ */
+inline void write_span(uint32_t* p, int count, int32_t r, int32_t g, int32_t b, int32_t dr, int32_t dg, int32_t db) {
+    int x = 0;
+#if defined(__AVX2__)
+    if (count >= 8) {
+        __m256i ramp = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i vr = _mm256_add_epi32(_mm256_set1_epi32(r), _mm256_mullo_epi32(_mm256_set1_epi32(dr), ramp));
+        __m256i vg = _mm256_add_epi32(_mm256_set1_epi32(g), _mm256_mullo_epi32(_mm256_set1_epi32(dg), ramp));
+        __m256i vb = _mm256_add_epi32(_mm256_set1_epi32(b), _mm256_mullo_epi32(_mm256_set1_epi32(db), ramp));
+        __m256i stepR = _mm256_set1_epi32(8 * dr), stepG = _mm256_set1_epi32(8 * dg), stepB = _mm256_set1_epi32(8 * db);
+        for (; x + 8 <= count; x += 8) {
+            _mm256_storeu_si256((__m256i*)(p + x), span_pixels(vr, vg, vb));
+            vr = _mm256_add_epi32(vr, stepR);
+            vg = _mm256_add_epi32(vg, stepG);
+            vb = _mm256_add_epi32(vb, stepB);
+        }
+    }
+#elif defined(__SSE4_1__)
+    if (count >= 4) {
+        __m128i ramp = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i vr = _mm_add_epi32(_mm_set1_epi32(r), _mm_mullo_epi32(_mm_set1_epi32(dr), ramp));
+        __m128i vg = _mm_add_epi32(_mm_set1_epi32(g), _mm_mullo_epi32(_mm_set1_epi32(dg), ramp));
+        __m128i vb = _mm_add_epi32(_mm_set1_epi32(b), _mm_mullo_epi32(_mm_set1_epi32(db), ramp));
+        __m128i stepR = _mm_set1_epi32(4 * dr), stepG = _mm_set1_epi32(4 * dg), stepB = _mm_set1_epi32(4 * db);
+        for (; x + 4 <= count; x += 4) {
+            _mm_storeu_si128((__m128i*)(p + x), span_pixels(vr, vg, vb));
+            vr = _mm_add_epi32(vr, stepR);
+            vg = _mm_add_epi32(vg, stepG);
+            vb = _mm_add_epi32(vb, stepB);
+        }
+    }
+#endif
+    // The rest one by one
+    r += x * dr;
+    g += x * dg;
+    b += x * db;
+    for (; x < count; x++) {
+        p[x] = span_pixel(r, g, b);
+        r += dr;
+        g += dg;
+        b += db;
+    }
+}
+
+/**
+ * Writes the pixels [from, to) of row y of any sink, one by one.
+ */
+template <class Sink>
+void put_span(Sink& sink, int y, int from, int to, int32_t r, int32_t g, int32_t b, int32_t dr, int32_t dg, int32_t db) {
+    STAT_HSPAN(from, y, to - from);
+    for (int x = from; x < to; x++) {
+        sink.put(x, y, sink.map_packed(span_pixel(r, g, b)));
+        r += dr;
+        g += dg;
+        b += db;
+    }
+}
+
+// Same for memory sinks, cut to the sink and written with write_span
+template <class Sink>
+void put_memory_span(Sink& sink, int y, int from, int to, int32_t r, int32_t g, int32_t b, int32_t dr, int32_t dg, int32_t db) {
+    if ((unsigned)y >= (unsigned)sink.height) return;
+    if (from < 0) {
+        r -= from * dr;
+        g -= from * dg;
+        b -= from * db;
+        from = 0;
+    }
+    to = min(to, sink.width);
+    STAT_HSPAN(from, y, to - from);
+    if (from < to) write_span(sink.row(y) + from, to - from, r, g, b, dr, dg, db);
+}
+inline void put_span(framebuffer_sink& sink, int y, int from, int to, int32_t r, int32_t g, int32_t b, int32_t dr, int32_t dg, int32_t db) {
+    put_memory_span(sink, y, from, to, r, g, b, dr, dg, db);
+}
+inline void put_span(locked_bitmap_sink& sink, int y, int from, int to, int32_t r, int32_t g, int32_t b, int32_t dr, int32_t dg, int32_t db) {
+    put_memory_span(sink, y, from, to, r, g, b, dr, dg, db);
+}
+
 // ---------------------------- Forward declarations -------------------------- //
 void init();
 void deinit();
@@ -77,10 +451,95 @@ void draw();
 
 
 // You will need to implement or extend these functions
+template <class Sink>
+void color_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                    const clip_rect& clip = NO_CLIP);
+template <class Sink>
+void draw_horizontal_line(Sink& sink, float x1, vector3f color1, float x2, vector3f color2, int y,
+                          const clip_rect& clip = NO_CLIP);
+template <class Sink>
+void fill_flat_bottom_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                               const clip_rect& clip = NO_CLIP);
+template <class Sink>
+void fill_flat_top_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                            const clip_rect& clip = NO_CLIP);
+
+// Draws through Allegro with al_put_pixel
 void color_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3);
-void draw_horizontal_line(float x1, vector3f color1, float x2, vector3f color2, int y);
-void fill_flat_bottom_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3);
-void fill_flat_top_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3);
+
+// Scanline filler in 28.4 fixed point, where triangles sharing an edge never draw a pixel twice
+template <class Sink>
+void color_triangle_fixed(Sink& sink, float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3,
+                          const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void color_triangle_fixed(float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3);
+
+// Indexed triangle meshes through the fixed-point filler.
+// Besides triangles with no area, back faces (counter-clockwise on screen) can be skipped.
+enum cull_mode {
+    CULL_NONE,
+    CULL_BACK
+};
+template <class Sink>
+void color_triangles(Sink& sink, const vector3f* vertices, const vector3f* colors, const int* indices, int count,
+                     cull_mode cull = CULL_BACK, const clip_rect& clip = NO_CLIP);
+void color_triangles(const vector3f* vertices, const vector3f* colors, const int* indices, int count, cull_mode cull = CULL_BACK);
+
+// Edge-function rasterizer over 8x8 blocks, for memory sinks
+template <class Sink>
+void color_triangle_halfspace(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                              const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void color_triangle_halfspace(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3);
+
+// Half-space rasterizer with a depth test, colors interpolated with perspective
+struct depth_buffer;
+template <class Sink>
+void color_triangle_depth(Sink& sink, depth_buffer& depth, vector3f p1, vector3f p2, vector3f p3, float w1, float w2, float w3,
+                          vector3f c1, vector3f c2, vector3f c3, const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void color_triangle_depth(depth_buffer& depth, vector3f p1, vector3f p2, vector3f p3, float w1, float w2, float w3,
+                          vector3f c1, vector3f c2, vector3f c3);
+
+// Half-space rasterizer sampling a mip-mapped texture with perspective
+struct texture;
+enum texture_filter {
+    TEXTURE_BILINEAR,   // Bilinear within the nearest mip level
+    TEXTURE_TRILINEAR   // Bilinear within the two nearest mip levels, blended
+};
+template <class Sink>
+void texture_triangle(Sink& sink, const texture& tex, int x1, int y1, int x2, int y2, int x3, int y3, float w1, float w2, float w3,
+                      vector3f t1, vector3f t2, vector3f t3, texture_filter filter, const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void texture_triangle(const texture& tex, int x1, int y1, int x2, int y2, int x3, int y3, float w1, float w2, float w3,
+                      vector3f t1, vector3f t2, vector3f t3, texture_filter filter);
+
+// Half-space rasterizer over meshes with any number of varyings, kept as a structure of arrays
+struct vertex_streams;
+template <class Sink, class Shader>
+void shade_triangles(Sink& sink, const vertex_streams& vertices, const int* indices, int count, const Shader& shader,
+                     const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap, with the first three varyings as red, green and blue
+void shade_triangles(const vertex_streams& vertices, const int* indices, int count);
+
+// Half-space rasterizer with 4 or 8 samples per pixel, blending partly covered pixels
+template <class Sink>
+void color_triangle_aa(Sink& sink, float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3,
+                       int samples, const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void color_triangle_aa(float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3, int samples);
+
+// Triangles in homogeneous clip space, projected and drawn with color_triangle_depth.
+// Only those crossing the near plane or leaving a guard band around the screen are clipped.
+struct clip_vertex;
+template <class Sink>
+void project_triangle(Sink& sink, depth_buffer& depth, const clip_vertex& v1, const clip_vertex& v2, const clip_vertex& v3,
+                      const clip_rect& clip = NO_CLIP);
+// Same into the locked target bitmap
+void project_triangle(depth_buffer& depth, const clip_vertex& v1, const clip_vertex& v2, const clip_vertex& v3);
+
+// Headless checks and timings of the rasterizers, see the Benchmark section at the end
+int run_benchmark(int argc, char** argv);
 
 // Utility functions
 void sort_triangle_with_attributes(int& x1, int& y1, int& x2, int& y2, int& x3, int& y3, vector3f& c1, vector3f& c2, vector3f& c3);
@@ -89,7 +548,13 @@ void sort_triangle_with_attributes(int& x1, int& y1, int& x2, int& y2, int& x3,
 // ---------------------------- Main -------------------------- //
 // The overall structure of our program is the familiar GUI event loop:
 
-int main(){
+int main(int argc, char** argv){
+    // "--bench" runs the benchmark instead of opening a window, "--fps N" redraws N times a second
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--bench") return run_benchmark(argc, argv);
+        if (string(argv[i]) == "--fps" && i + 1 < argc) max_fps = atof(argv[++i]);
+    }
+
     init();         // Initialize Allegro.
     event_loop();   // Run the event processing loop until a program is requested to quit
     deinit();       // Deinitialize
@@ -103,7 +568,9 @@ int main(){
 
 void init() {
     al_init();
-    display = al_create_display(600, 200);
+    // Expose events tell when the window has to be drawn again, see event_loop
+    al_set_new_display_flags(ALLEGRO_WINDOWED | ALLEGRO_RESIZABLE | ALLEGRO_GENERATE_EXPOSE_EVENTS);
+    display = al_create_display(600, 350);
     event_queue = al_create_event_queue();
     al_register_event_source(event_queue, al_get_display_event_source(display));
     al_install_keyboard();
@@ -121,18 +588,45 @@ void deinit() {
 
 // ---------------------------- Event loop -------------------------- //
 
+// The scene only changes when something happens, so instead of redrawing on a fixed period
+// the loop sleeps in al_wait_for_event and marks the frame dirty when the window was exposed,
+// resized or got input, and with max_fps above 0 on every tick of a timer for animated scenes.
+// A frame is drawn once the queue is empty, so a burst of events costs a single redraw.
+
 void event_loop() {
-    while(1) {
-        // We only need events to close the app when necessary
-        bool have_event = al_wait_for_event_timed(event_queue, &event, 0.05);
-        if (have_event) {
-            if (event.type == ALLEGRO_EVENT_DISPLAY_CLOSE || event.type == ALLEGRO_EVENT_KEY_DOWN) break;
+    ALLEGRO_TIMER* timer = NULL;
+    if (max_fps > 0) {
+        timer = al_create_timer(1.0 / max_fps);
+        al_register_event_source(event_queue, al_get_timer_event_source(timer));
+        al_start_timer(timer);
+    }
+
+    bool dirty = true;  // The first frame
+    bool quit = false;
+    while (!quit) {
+        if (dirty && al_is_event_queue_empty(event_queue)) {
+            draw();
+            dirty = false;
         }
-        // No animation this time, simply drawing
-        draw();
-        // Sleep for 1ms
-        usleep(1000);
-   }
+        al_wait_for_event(event_queue, &event);
+        switch (event.type) {
+        case ALLEGRO_EVENT_DISPLAY_CLOSE:
+        case ALLEGRO_EVENT_KEY_DOWN:
+            quit = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_RESIZE:
+            al_acknowledge_resize(display);
+            dirty = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_EXPOSE:
+        case ALLEGRO_EVENT_DISPLAY_SWITCH_IN:
+        case ALLEGRO_EVENT_TIMER:
+            dirty = true;
+            break;
+        }
+    }
+
+    if (timer) al_destroy_timer(timer);
 }
 
 // ---------------------------- Drawing routines -------------------------- //
@@ -141,6 +635,9 @@ void event_loop() {
 void draw() {
     //clear the buffer from last frame
     al_clear_to_color(al_color_name("white"));
+#ifdef RASTER_STATS
+    stats.reset(al_get_display_width(display), al_get_display_height(display));
+#endif
 
     // Here we test the implementations of the algorithms.
     // We shall draw four sample triangles for each method
@@ -169,6 +666,27 @@ void draw() {
         OX += 150;
     }
 
+    // The same triangles with the half-space rasterizer
+    OX = 0;
+    OY = 190;
+    for (int i = 0; i < NUM_TRIANGLES; i++) {
+        color_triangle_halfspace(triangles[i][0][0] + OX, triangles[i][0][1] + OY,
+                                 triangles[i][1][0] + OX, triangles[i][1][1] + OY,
+                                 triangles[i][2][0] + OX, triangles[i][2][1] + OY,
+                                 red, green, blue);
+        OX += 150;
+    }
+
+#ifdef RASTER_STATS
+    // Every frame draws the same, so the first one is reported
+    static bool reported = false;
+    if (!reported) {
+        stats.print(stdout);
+        write_overdraw_ppm("overdraw.ppm");
+        reported = true;
+    }
+#endif
+
     // We end by flipping the buffer:
     al_flip_display();
 }
@@ -177,86 +695,2098 @@ void draw() {
 
 /**
  * Draws a triangle with color gradient
- * You don't have to add anything to this method, but instead
- * implement the methods fill_flat_bottom_triangle and fill_flat_top_triangle.
+ * The general case is split at the middle vertex into a flat bottom and a flat top triangle.
+ * The scanline of the middle vertex belongs to the flat top one.
  */
-void color_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
+template <class Sink>
+void color_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                    const clip_rect& clip) {
     // Sort points vertically
     sort_triangle_with_attributes(x1, y1, x2, y2, x3, y3, c1, c2, c3);
 
     /* Special case where triangle has flat bottom */
     if(y2 == y3) {
-        fill_flat_bottom_triangle(x1, y1, x2, y2, x3, y3, c1, c2, c3);
+        fill_flat_bottom_triangle(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3, clip);
     /* Special case where triangle has flat top */
     } else if (y1 == y2) {
-        fill_flat_top_triangle(x1, y1, x2, y2, x3, y3, c1, c2, c3);
+        fill_flat_top_triangle(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3, clip);
     /* General case*/
     } else {
-        fill_flat_top_triangle(x1, y1, x2, y2, x3, y3, c1, c2, c3);
-        fill_flat_bottom_triangle(x1, y1, x2, y2, x3, y3, c1, c2, c3);
+        // Point on the long edge at the height of the middle vertex
+        float t = float(y2 - y1) / (y3 - y1);
+        int x4 = (int)round(x1 + t * (x3 - x1));
+        vector3f c4 = c1 + (c3 - c1) * t;
+        clip_rect upper = clip;
+        upper.y1 = min(clip.y1, y2 - 1);
+        fill_flat_bottom_triangle(sink, x1, y1, x2, y2, x4, y2, c1, c2, c4, upper);
+        fill_flat_top_triangle(sink, x2, y2, x4, y2, x3, y3, c2, c4, c3, clip);
     }
 
 }
 
+void color_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
+    allegro_sink sink;
+    color_triangle(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3);
+}
+
 /**
- * --Task--
- * Finish this function.
- * It should increase y and move on both non-horizontal lines of the triangle, changing the color and x.
+ * Fills a triangle whose bottom edge (x2, y2)-(x3, y3) is horizontal.
+ * It increases y and moves on both non-horizontal lines of the triangle, changing the color and x.
+ * Every row is computed from the top vertex rather than accumulated, so rows outside the clip
+ * rectangle can be skipped without changing the others.
  */
-void fill_flat_bottom_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
-    // 1) Find how much x should change, when y changes by 1 for both lines (e.g. deltaX1, deltaX2)
-    //        float deltaXA = float(x1 - x3) / (y1 - y3);
-    // 2) Find how much the color should change, when y changes by 1 for both lines.
-    // 3) Make some variables to hold the current x and color values
-    // 4) Create a loop, where we change the y by 1 and then add the change of x and color to the corresponding variables.
-    // 4.1) Inside the loop call the horizontal gradient line drawing function (draw_horizontal_line).
+template <class Sink>
+void fill_flat_bottom_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                               const clip_rect& clip) {
+    if (y2 == y1) { // Degenerate, the whole triangle is one line
+        draw_horizontal_line(sink, x2, c2, x3, c3, y2, clip);
+        return;
+    }
+    // How much x and the color change when y changes by 1 on both lines
+    float deltaXA = float(x2 - x1) / (y2 - y1);
+    float deltaXB = float(x3 - x1) / (y3 - y1);
+    vector3f deltaCA = (c2 - c1) / (y2 - y1);
+    vector3f deltaCB = (c3 - c1) / (y3 - y1);
+
+    for (int y = max(y1, clip.y0); y <= min(y2, clip.y1); y++) {
+        float steps = y - y1;
+        draw_horizontal_line(sink, x1 + deltaXA * steps, c1 + deltaCA * steps,
+                                   x1 + deltaXB * steps, c1 + deltaCB * steps, y, clip);
+    }
 }
 
 /**
- * --Task--
- * Finish this function also.
+ * Fills a triangle whose top edge (x1, y1)-(x2, y2) is horizontal.
+ * Same as flat bottom triangle, but starts from the bottom vertex.
  */
-void fill_flat_top_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
-    // Same as flat bottom triangle, but start from bottom vertex.
+template <class Sink>
+void fill_flat_top_triangle(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                            const clip_rect& clip) {
+    if (y3 == y1) {
+        draw_horizontal_line(sink, x1, c1, x2, c2, y1, clip);
+        return;
+    }
+    float deltaXA = float(x3 - x1) / (y3 - y1);
+    float deltaXB = float(x3 - x2) / (y3 - y2);
+    vector3f deltaCA = (c3 - c1) / (y3 - y1);
+    vector3f deltaCB = (c3 - c2) / (y3 - y2);
+
+    for (int y = min(y3, clip.y1); y >= max(y1, clip.y0); y--) {
+        float steps = y3 - y;
+        draw_horizontal_line(sink, x3 - deltaXA * steps, c3 - deltaCA * steps,
+                                   x3 - deltaXB * steps, c3 - deltaCB * steps, y, clip);
+    }
 }
 
 /**
- * --Task--
  * This method draws a horizontal line from (x1, y) to (x2, y)
- * Your task is to implement color gradient for the horizontal axis
+ * with the color changing linearly from color1 to color2.
  */
-void draw_horizontal_line(float x1, vector3f color1, float x2, vector3f color2, int y) {
+template <class Sink>
+void draw_horizontal_line(Sink& sink, float x1, vector3f color1, float x2, vector3f color2, int y, const clip_rect& clip) {
+    if (y < clip.y0 || y > clip.y1) return;
     if (x1 > x2) {
         swap(x1, x2);
         swap(color1, color2);
     }
 
-    //Find how much the color should change for 1 unit of change in the x direction.
+    // How much the color changes for 1 unit of change in the x direction
+    vector3f deltaColor = (x2 > x1) ? (color2 - color1) / (x2 - x1) : vector3f(0, 0, 0);
+
+    int start = x1;
+    int from = max(start, clip.x0), to = min((int)floorf(x2), clip.x1) + 1;
+    if (from >= to) return;
+
+    // Handed to the span writer as 16.16 fixed point over 0..255
+    const float scale = 255 * 65536.0f;
+    vector3f c = (color1 + deltaColor * float(from - start)) * scale + vector3f(32768, 32768, 32768);
+    vector3f d = deltaColor * scale;
+    put_span(sink, y, from, to, lrintf(c.x), lrintf(c.y), lrintf(c.z), lrintf(d.x), lrintf(d.y), lrintf(d.z));
+}
+
+// ----------------------- Fixed-point scanline filler ------------------------ //
+// Vertices are snapped to 28.4 fixed point, i.e. 1/16 of a pixel, and everything after that is
+// integer. Pixels are sampled at their integer coordinates. A row is drawn if its y is at or below
+// the top vertex and above the bottom one; a pixel is drawn if its x is at or right of the left
+// edge and left of the right edge. So a row through a shared vertex and a pixel on a shared edge
+// belong to exactly one of two neighbouring triangles, and a mesh is drawn without seams or
+// pixels written twice. These are the same pixels as color_triangle_halfspace draws.
+
+const int SUBPIXEL_BITS = 4;
+const int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+inline int to_subpixel(float f) {
+    return (int)lrintf(f * SUBPIXEL_ONE);
+}
+
+// Rounds a / b towards minus infinity, for b > 0
+inline int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b < 0) ? q - 1 : q;
+}
+
+// Smallest integer at or above v / SUBPIXEL_ONE
+inline int subpixel_ceil(int v) {
+    return (int)floor_div((int64_t)v + SUBPIXEL_ONE - 1, SUBPIXEL_ONE);
+}
+
+// A vertex snapped to 28.4, with its color
+struct fixed_vertex {
+    int x, y;
+    vector3f color;
+};
+
+inline fixed_vertex snap_vertex(float x, float y, vector3f color) {
+    fixed_vertex v = {to_subpixel(x), to_subpixel(y), color};
+    return v;
+}
+
+/**
+ * How far an edge from a to b, with a above b, moves per row: whole pixels and a fraction in
+ * 1 / denominator. Horizontal edges are never walked and get all zeros.
+ */
+struct edge_step {
+    int step;
+    int64_t stepRemainder, denominator;
+
+    edge_step(): step(0), stepRemainder(0), denominator(0) {};
+    edge_step(const fixed_vertex& a, const fixed_vertex& b): step(0), stepRemainder(0), denominator(0) {
+        if (b.y == a.y) return;
+        denominator = SUBPIXEL_ONE * (int64_t)(b.y - a.y);
+        int64_t perRow = SUBPIXEL_ONE * (int64_t)(b.x - a.x);
+        step = (int)floor_div(perRow, denominator);
+        stepRemainder = perRow - step * denominator;
+    }
+};
+
+/**
+ * Walks an edge row by row. x is the first pixel at or right of the edge on the current row,
+ * the exact position being x - remainder / denominator: the division is carried in integers
+ * like the error term of Bresenham, so the edge never drifts.
+ */
+struct scan_edge {
+    int x;
+    int64_t remainder;
+    edge_step s;
 
-    for (int x = x1; x <= x2; x++) {
-        al_put_pixel(x, y, color1.as_color());
+    // The edge from a to b, a above b, positioned on row y
+    scan_edge(const fixed_vertex& a, const fixed_vertex& b, const edge_step& s, int y): s(s) {
+        int64_t dx = b.x - a.x, dy = b.y - a.y;
+        // x on row y is (a.x * dy + (y * SUBPIXEL_ONE - a.y) * dx) / (SUBPIXEL_ONE * dy) pixels
+        int64_t numerator = a.x * dy + ((int64_t)y * SUBPIXEL_ONE - a.y) * dx;
+        x = (int)-floor_div(-numerator, s.denominator);
+        remainder = (int64_t)x * s.denominator - numerator;
+    }
+    // Moves to the next row, returns how many pixels x moved
+    int next() {
+        int moved = s.step;
+        remainder -= s.stepRemainder;
+        if (remainder < 0) {
+            moved++;
+            remainder += s.denominator;
+        }
+        x += moved;
+        return moved;
+    }
+};
 
-        //Add that change to the color
+/**
+ * Fills the rows [yStart, yEnd) between two edges. The colors are 16.16 fixed-point planes over
+ * 0..255; color holds them at the left edge of the first row and is stepped along with it.
+ */
+template <class Sink>
+void fill_fixed_rows(Sink& sink, scan_edge& left, scan_edge& right, int yStart, int yEnd, int64_t color[3],
+                     const int32_t dx[3], const int32_t dy[3], const clip_rect& clip) {
+    for (int y = yStart; y < yEnd; y++) {
+        int from = max(left.x, clip.x0), to = min(right.x, clip.x1 + 1);
+        if (from < to) {
+            // Rounding of the gradients can take a channel a fraction past 0 or 255, the span writer clamps it
+            int skip = from - left.x;
+            put_span(sink, y, from, to, (int32_t)(color[0] + (int64_t)dx[0] * skip), (int32_t)(color[1] + (int64_t)dx[1] * skip),
+                     (int32_t)(color[2] + (int64_t)dx[2] * skip), dx[0], dx[1], dx[2]);
+        }
+        int moved = left.next();
+        right.next();
+        for (int i = 0; i < 3; i++) color[i] += dy[i] + (int64_t)dx[i] * moved;
     }
 }
 
-// ----------------------- Utility functions ------------------------ //
+/**
+ * Fills a triangle whose vertices are sorted from top to bottom, given the steps of its long edge
+ * v1 -> v3 and of the short ones v1 -> v2 and v2 -> v3.
+ * Rows are walked between the long edge and the two short ones, split at the middle vertex;
+ * edges and colors are stepped in integers only. Triangles with no area draw nothing.
+ */
+template <class Sink>
+void fill_fixed_triangle(Sink& sink, const fixed_vertex& v1, const fixed_vertex& v2, const fixed_vertex& v3,
+                         const edge_step& longStep, const edge_step& upperStep, const edge_step& lowerStep, const clip_rect& clip) {
+    // Twice the area, positive when the middle vertex is right of the long edge
+    int64_t cross = (int64_t)(v2.x - v1.x) * (v3.y - v1.y) - (int64_t)(v2.y - v1.y) * (v3.x - v1.x);
+    if (cross == 0) {
+        STAT_CULLED();
+        return;
+    }
+    bool longLeft = cross > 0;
+
+    // Color planes c(x, y) = c1 + dx * (x - x1) + dy * (y - y1) in pixels, as 16.16 over 0..255
+    double px1 = v1.x / (double)SUBPIXEL_ONE, py1 = v1.y / (double)SUBPIXEL_ONE;
+    double ex2 = (v2.x - v1.x) / (double)SUBPIXEL_ONE, ey2 = (v2.y - v1.y) / (double)SUBPIXEL_ONE;
+    double ex3 = (v3.x - v1.x) / (double)SUBPIXEL_ONE, ey3 = (v3.y - v1.y) / (double)SUBPIXEL_ONE;
+    double scale = 255 * 65536 / (ex2 * ey3 - ey2 * ex3);
+    double channels[3][3] = {{v1.color.x, v2.color.x, v3.color.x}, {v1.color.y, v2.color.y, v3.color.y}, {v1.color.z, v2.color.z, v3.color.z}};
+    int32_t dx[3], dy[3];
+    double origin[3];
+    for (int i = 0; i < 3; i++) {
+        double d2 = channels[i][1] - channels[i][0], d3 = channels[i][2] - channels[i][0];
+        double gx = (d2 * ey3 - d3 * ey2) * scale;
+        double gy = (d3 * ex2 - d2 * ex3) * scale;
+        // Slivers have gradients far past 32 bits. Only the low 32 bits of a color reach the span
+        // writer, so the steps are wrapped mod 2^32 on purpose; llrint, as long may be 32-bit.
+        dx[i] = (int32_t)(uint32_t)llrint(gx);
+        dy[i] = (int32_t)(uint32_t)llrint(gy);
+        origin[i] = (channels[i][0] * 255 + 0.5) * 65536 - gx * px1 - gy * py1;  // Plane at (0, 0)
+    }
+
+    // Rows with y at or below a vertex and above the next one, inside the clip rectangle
+    int top = max(subpixel_ceil(v1.y), clip.y0);
+    int middle = min(max(subpixel_ceil(v2.y), top), clip.y1 + 1);
+    int bottom = min(subpixel_ceil(v3.y), clip.y1 + 1);
+
+    int64_t color[3];
+    if (top < middle) {
+        scan_edge longEdge(v1, v3, longStep, top), shortEdge(v1, v2, upperStep, top);
+        scan_edge& left = longLeft ? longEdge : shortEdge;
+        for (int i = 0; i < 3; i++) color[i] = llrint(origin[i] + (double)dx[i] * left.x + (double)dy[i] * top);
+        fill_fixed_rows(sink, left, longLeft ? shortEdge : longEdge, top, middle, color, dx, dy, clip);
+    }
+    middle = max(middle, top);
+    if (middle < bottom) {
+        scan_edge longEdge(v1, v3, longStep, middle), shortEdge(v2, v3, lowerStep, middle);
+        scan_edge& left = longLeft ? longEdge : shortEdge;
+        for (int i = 0; i < 3; i++) color[i] = llrint(origin[i] + (double)dx[i] * left.x + (double)dy[i] * middle);
+        fill_fixed_rows(sink, left, longLeft ? shortEdge : longEdge, middle, bottom, color, dx, dy, clip);
+    }
+}
 
 /**
- * Given three triangle vertices sorts them vertically.
- * Also sorts attribute vectors attached to the vertices.
+ * Draws a triangle with color gradient from sub-pixel vertices.
  */
-void sort_triangle_with_attributes(int& x1, int& y1, int& x2, int& y2, int& x3, int& y3, vector3f& c1, vector3f& c2, vector3f& c3) {
-    if (y2 > y3) {
-        swap(x2, x3); swap(y2, y3); swap(c2, c3);
+template <class Sink>
+void color_triangle_fixed(Sink& sink, float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3,
+                          const clip_rect& clip) {
+    fixed_vertex v[3] = {snap_vertex(x1, y1, c1), snap_vertex(x2, y2, c2), snap_vertex(x3, y3, c3)};
+    if (v[1].y < v[0].y) swap(v[0], v[1]);
+    if (v[2].y < v[1].y) swap(v[1], v[2]);
+    if (v[1].y < v[0].y) swap(v[0], v[1]);
+    fill_fixed_triangle(sink, v[0], v[1], v[2], edge_step(v[0], v[2]), edge_step(v[0], v[1]), edge_step(v[1], v[2]), clip);
+}
+
+void color_triangle_fixed(float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Through al_put_pixel when the target is already locked
+        allegro_sink target;
+        color_triangle_fixed(target, x1, y1, x2, y2, x3, y3, c1, c2, c3);
+        return;
     }
-    if (y1 > y2) {
-        swap(x1, x2); swap(y1, y2); swap(c1, c2);
+    color_triangle_fixed(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3);
+    sink.unlock();
+}
+
+// ----------------------- Indexed meshes ------------------------ //
+// A mesh is a list of vertices and one of triangles, three vertex indices each. Every vertex is
+// snapped once for all the triangles using it, and since an edge is usually shared by two
+// triangles, the steps of recently walked edges are kept in a small cache keyed by their two
+// vertices. Triangles that cannot draw anything are dropped before any setup.
+
+/**
+ * Direct-mapped cache of edge steps. An edge is keyed by its upper and lower vertex, so both
+ * triangles sharing it find the same entry.
+ */
+struct edge_cache {
+    static const int SIZE = 1024;
+    struct entry {
+        int upper, lower;
+        edge_step step;
+    };
+    vector<entry> entries;
+
+    edge_cache(): entries(SIZE) {
+        for (int i = 0; i < SIZE; i++) entries[i].upper = -1;
     }
-    if (y2 > y3) {
+    edge_step get(const fixed_vertex* vertices, int upper, int lower) {
+        entry& e = entries[(unsigned)(upper * 31 + lower) & (SIZE - 1)];
+        if (e.upper != upper || e.lower != lower) {
+            e.upper = upper;
+            e.lower = lower;
+            e.step = edge_step(vertices[upper], vertices[lower]);
+        }
+        return e.step;
+    }
+};
+
+/**
+ * Draws count triangles of a mesh; triangle i uses the vertices indices[3 * i] to indices[3 * i + 2].
+ * Positions are in pixels, their z is not used. Pixels are the same as with color_triangle_fixed.
+ */
+template <class Sink>
+void color_triangles(Sink& sink, const vector3f* vertices, const vector3f* colors, const int* indices, int count,
+                     cull_mode cull, const clip_rect& clip) {
+    int vertexCount = 0;
+    for (int i = 0; i < 3 * count; i++) vertexCount = max(vertexCount, indices[i] + 1);
+    vector<fixed_vertex> snapped;
+    snapped.reserve(vertexCount);
+    for (int i = 0; i < vertexCount; i++) snapped.push_back(snap_vertex(vertices[i].x, vertices[i].y, colors[i]));
+    const fixed_vertex* v = snapped.data();
+
+    edge_cache cache;
+    for (int t = 0; t < count; t++) {
+        int a = indices[3 * t], b = indices[3 * t + 1], c = indices[3 * t + 2];
+
+        // Twice the area, positive when clockwise on screen
+        int64_t area = (int64_t)(v[b].x - v[a].x) * (v[c].y - v[a].y) - (int64_t)(v[b].y - v[a].y) * (v[c].x - v[a].x);
+        if (area == 0 || (cull == CULL_BACK && area < 0)) {
+            STAT_CULLED();
+            continue;
+        }
+
+        // Entirely outside the clip rectangle
+        if (subpixel_ceil(max(v[a].x, max(v[b].x, v[c].x))) <= clip.x0 || subpixel_ceil(min(v[a].x, min(v[b].x, v[c].x))) > clip.x1 ||
+            subpixel_ceil(max(v[a].y, max(v[b].y, v[c].y))) <= clip.y0 || subpixel_ceil(min(v[a].y, min(v[b].y, v[c].y))) > clip.y1) {
+            STAT_CULLED();
+            continue;
+        }
+
+        if (v[b].y < v[a].y) swap(a, b);
+        if (v[c].y < v[b].y) swap(b, c);
+        if (v[b].y < v[a].y) swap(a, b);
+        fill_fixed_triangle(sink, v[a], v[b], v[c], cache.get(v, a, c), cache.get(v, a, b), cache.get(v, b, c), clip);
+    }
+}
+
+void color_triangles(const vector3f* vertices, const vector3f* colors, const int* indices, int count, cull_mode cull) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        allegro_sink target;
+        color_triangles(target, vertices, colors, indices, count, cull);
+        return;
+    }
+    color_triangles(sink, vertices, colors, indices, count, cull);
+    sink.unlock();
+}
+
+// ----------------------- Half-space rasterizer ------------------------ //
+// Instead of walking the edges, every pixel is tested against the three edge functions of the
+// triangle, which are positive inside. Being linear, they can be stepped by adding constants and
+// evaluated for eight neighbouring pixels at once. The screen is walked in 8x8 blocks: the corners
+// of a block tell whether it lies entirely outside one edge (skipped) or inside all three (filled
+// without any test), so only blocks on the edges are tested pixel by pixel.
+// Pixels are sampled at their integer coordinates, like the vertices. A pixel exactly on an edge
+// belongs to the triangle only if that is a top or a left edge, so triangles sharing an edge
+// never draw its pixels twice and never leave a gap.
+
+const int BLOCK_SIZE = 8;   // One row of a block is one vector of lanes
+
+#if defined(__AVX2__)
+typedef __m256i lanes;
+typedef __m256 lanesf;
+inline lanes lanes_set(int32_t i)                 { return _mm256_set1_epi32(i); }
+inline lanes lanes_ramp(int32_t step)             { return _mm256_mullo_epi32(_mm256_set1_epi32(step), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)); }
+inline lanes lanes_add(lanes a, lanes b)          { return _mm256_add_epi32(a, b); }
+inline lanes lanes_and(lanes a, lanes b)          { return _mm256_and_si256(a, b); }
+inline lanes lanes_or(lanes a, lanes b)           { return _mm256_or_si256(a, b); }
+inline lanes lanes_gt(lanes a, lanes b)           { return _mm256_cmpgt_epi32(a, b); }
+inline int lanes_mask(lanes a)                    { return _mm256_movemask_ps(_mm256_castsi256_ps(a)); }
+inline void lanes_store(uint32_t* p, lanes a)     { _mm256_storeu_si256((__m256i*)p, a); }
+inline void lanes_store_masked(uint32_t* p, lanes a, lanes mask) { _mm256_maskstore_epi32((int*)p, mask, a); }
+inline lanesf lanesf_set(float f)                 { return _mm256_set1_ps(f); }
+inline lanesf lanesf_ramp(float step)             { return _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)); }
+inline lanesf lanesf_add(lanesf a, lanesf b)      { return _mm256_add_ps(a, b); }
+inline lanesf lanesf_mul(lanesf a, lanesf b)      { return _mm256_mul_ps(a, b); }
+inline lanesf lanesf_div(lanesf a, lanesf b)      { return _mm256_div_ps(a, b); }
+inline lanes lanesf_lt(lanesf a, lanesf b)        { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+inline lanesf lanesf_load(const float* p)         { return _mm256_loadu_ps(p); }
+inline void lanesf_store(float* p, lanesf a)      { _mm256_storeu_ps(p, a); }
+inline void lanesf_store_masked(float* p, lanesf a, lanes mask) { _mm256_maskstore_ps(p, mask, a); }
+// Channels already scaled to 0..255 and offset for rounding, packed into 0xAABBGGRR pixels
+inline lanes lanes_pack(lanesf r, lanesf g, lanesf b) {
+    __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(255);
+    __m256i ir = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(r, zero), top));
+    __m256i ig = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(g, zero), top));
+    __m256i ib = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(b, zero), top));
+    return _mm256_or_si256(_mm256_or_si256(ir, _mm256_slli_epi32(ig, 8)),
+                           _mm256_or_si256(_mm256_slli_epi32(ib, 16), _mm256_set1_epi32(0xFF000000)));
+}
+#elif defined(__SSE4_1__)
+struct lanes { __m128i lo, hi; };
+struct lanesf { __m128 lo, hi; };
+inline lanes lanes_set(int32_t i)                 { lanes r = {_mm_set1_epi32(i), _mm_set1_epi32(i)}; return r; }
+inline lanes lanes_ramp(int32_t step)             { lanes r = {_mm_setr_epi32(0, step, 2 * step, 3 * step), _mm_setr_epi32(4 * step, 5 * step, 6 * step, 7 * step)}; return r; }
+inline lanes lanes_add(lanes a, lanes b)          { lanes r = {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)}; return r; }
+inline lanes lanes_and(lanes a, lanes b)          { lanes r = {_mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi)}; return r; }
+inline lanes lanes_or(lanes a, lanes b)           { lanes r = {_mm_or_si128(a.lo, b.lo), _mm_or_si128(a.hi, b.hi)}; return r; }
+inline lanes lanes_gt(lanes a, lanes b)           { lanes r = {_mm_cmpgt_epi32(a.lo, b.lo), _mm_cmpgt_epi32(a.hi, b.hi)}; return r; }
+inline int lanes_mask(lanes a) {
+    return _mm_movemask_ps(_mm_castsi128_ps(a.lo)) | (_mm_movemask_ps(_mm_castsi128_ps(a.hi)) << 4);
+}
+inline void lanes_store(uint32_t* p, lanes a)     { _mm_storeu_si128((__m128i*)p, a.lo); _mm_storeu_si128((__m128i*)p + 1, a.hi); }
+inline void lanes_store_masked(uint32_t* p, lanes a, lanes mask) {
+    alignas(16) uint32_t v[BLOCK_SIZE];
+    lanes_store(v, a);
+    for (int m = lanes_mask(mask); m; m &= m - 1) p[__builtin_ctz(m)] = v[__builtin_ctz(m)];
+}
+inline lanesf lanesf_set(float f)                 { lanesf r = {_mm_set1_ps(f), _mm_set1_ps(f)}; return r; }
+inline lanesf lanesf_ramp(float step)             { lanesf r = {_mm_setr_ps(0, step, 2 * step, 3 * step), _mm_setr_ps(4 * step, 5 * step, 6 * step, 7 * step)}; return r; }
+inline lanesf lanesf_add(lanesf a, lanesf b)      { lanesf r = {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)}; return r; }
+inline lanesf lanesf_mul(lanesf a, lanesf b)      { lanesf r = {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)}; return r; }
+inline lanesf lanesf_div(lanesf a, lanesf b)      { lanesf r = {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)}; return r; }
+inline lanes lanesf_lt(lanesf a, lanesf b)        { lanes r = {_mm_castps_si128(_mm_cmplt_ps(a.lo, b.lo)), _mm_castps_si128(_mm_cmplt_ps(a.hi, b.hi))}; return r; }
+inline lanesf lanesf_load(const float* p)         { lanesf r = {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)}; return r; }
+inline void lanesf_store(float* p, lanesf a)      { _mm_storeu_ps(p, a.lo); _mm_storeu_ps(p + 4, a.hi); }
+inline void lanesf_store_masked(float* p, lanesf a, lanes mask) {
+    alignas(16) float v[BLOCK_SIZE];
+    lanesf_store(v, a);
+    for (int m = lanes_mask(mask); m; m &= m - 1) p[__builtin_ctz(m)] = v[__builtin_ctz(m)];
+}
+inline __m128i pack_half(__m128 r, __m128 g, __m128 b) {
+    __m128 zero = _mm_setzero_ps(), top = _mm_set1_ps(255);
+    __m128i ir = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(r, zero), top));
+    __m128i ig = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(g, zero), top));
+    __m128i ib = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(b, zero), top));
+    return _mm_or_si128(_mm_or_si128(ir, _mm_slli_epi32(ig, 8)), _mm_or_si128(_mm_slli_epi32(ib, 16), _mm_set1_epi32(0xFF000000)));
+}
+inline lanes lanes_pack(lanesf r, lanesf g, lanesf b) {
+    lanes p = {pack_half(r.lo, g.lo, b.lo), pack_half(r.hi, g.hi, b.hi)};
+    return p;
+}
+#else
+struct lanes { int32_t v[BLOCK_SIZE]; };
+struct lanesf { float v[BLOCK_SIZE]; };
+inline lanes lanes_set(int32_t x)                 { lanes r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = x; return r; }
+inline lanes lanes_ramp(int32_t step)             { lanes r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = i * step; return r; }
+inline lanes lanes_add(lanes a, lanes b)          { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] += b.v[i]; return a; }
+inline lanes lanes_and(lanes a, lanes b)          { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] &= b.v[i]; return a; }
+inline lanes lanes_or(lanes a, lanes b)           { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] |= b.v[i]; return a; }
+inline lanes lanes_gt(lanes a, lanes b)           { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] = a.v[i] > b.v[i] ? -1 : 0; return a; }
+inline int lanes_mask(lanes a) {
+    int mask = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++) if (a.v[i] < 0) mask |= 1 << i;
+    return mask;
+}
+inline void lanes_store(uint32_t* p, lanes a)     { for (int i = 0; i < BLOCK_SIZE; i++) p[i] = a.v[i]; }
+inline void lanes_store_masked(uint32_t* p, lanes a, lanes mask) {
+    for (int i = 0; i < BLOCK_SIZE; i++) if (mask.v[i] < 0) p[i] = a.v[i];
+}
+inline lanesf lanesf_set(float f)                 { lanesf r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = f; return r; }
+inline lanesf lanesf_ramp(float step)             { lanesf r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = i * step; return r; }
+inline lanesf lanesf_add(lanesf a, lanesf b)      { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] += b.v[i]; return a; }
+inline lanesf lanesf_mul(lanesf a, lanesf b)      { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] *= b.v[i]; return a; }
+inline lanesf lanesf_div(lanesf a, lanesf b)      { for (int i = 0; i < BLOCK_SIZE; i++) a.v[i] /= b.v[i]; return a; }
+inline lanes lanesf_lt(lanesf a, lanesf b)        { lanes r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = a.v[i] < b.v[i] ? -1 : 0; return r; }
+inline lanesf lanesf_load(const float* p)         { lanesf r; for (int i = 0; i < BLOCK_SIZE; i++) r.v[i] = p[i]; return r; }
+inline void lanesf_store(float* p, lanesf a)      { for (int i = 0; i < BLOCK_SIZE; i++) p[i] = a.v[i]; }
+inline void lanesf_store_masked(float* p, lanesf a, lanes mask) {
+    for (int i = 0; i < BLOCK_SIZE; i++) if (mask.v[i] < 0) p[i] = a.v[i];
+}
+inline lanes lanes_pack(lanesf r, lanesf g, lanesf b) {
+    lanes p;
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        uint32_t ir = (uint32_t)min(255.0f, max(0.0f, r.v[i]));
+        uint32_t ig = (uint32_t)min(255.0f, max(0.0f, g.v[i]));
+        uint32_t ib = (uint32_t)min(255.0f, max(0.0f, b.v[i]));
+        p.v[i] = ir | (ig << 8) | (ib << 16) | 0xFF000000;
+    }
+    return p;
+}
+#endif
+
+/**
+ * E(x, y) = a * x + b * y + c of the edge from (x1, y1) to (x2, y2), positive on the side
+ * where a clockwise (on screen) triangle lies. Pixels on edges that are neither top nor left
+ * edges get -1, which moves them outside.
+ */
+struct edge_function {
+    int32_t a, b, c;
+
+    edge_function(int x1, int y1, int x2, int y2) {
+        a = y1 - y2;
+        b = x2 - x1;
+        c = x1 * y2 - y1 * x2;
+        bool top = y1 == y2 && x2 > x1;  // Horizontal with the triangle below
+        bool left = y2 < y1;             // Going up, with the triangle on its right
+        if (!top && !left) c -= 1;
+    }
+    int32_t at(int x, int y) const {
+        return a * x + b * y + c;
+    }
+};
+
+/**
+ * Tells from the corners of the block at (bx, by) whether it lies entirely outside one of the
+ * edges, or entirely inside all three.
+ */
+inline void classify_block(const edge_function* edges, int bx, int by, bool& outside, bool& inside) {
+    outside = false;
+    inside = true;
+    for (int e = 0; e < 3; e++) {
+        const edge_function& f = edges[e];
+        int32_t corner = f.at(bx, by);
+        int32_t low = corner + min(f.a, 0) * (BLOCK_SIZE - 1) + min(f.b, 0) * (BLOCK_SIZE - 1);
+        int32_t high = corner + max(f.a, 0) * (BLOCK_SIZE - 1) + max(f.b, 0) * (BLOCK_SIZE - 1);
+        if (high < 0) outside = true;
+        if (low < 0) inside = false;
+    }
+}
+
+// The pixels of row y of the block at bx that are inside all three edges; ramp holds the steps of a along the row
+inline lanes row_coverage(const edge_function* edges, const lanes* ramp, int bx, int y) {
+    lanes w = lanes_or(lanes_or(lanes_add(lanes_set(edges[0].at(bx, y)), ramp[0]),
+                                lanes_add(lanes_set(edges[1].at(bx, y)), ramp[1])),
+                       lanes_add(lanes_set(edges[2].at(bx, y)), ramp[2]));
+    return lanes_gt(w, lanes_set(-1));
+}
+
+/**
+ * Draws a triangle with a color gradient using edge functions over 8x8 blocks.
+ * The colors are interpolated with plane equations, the same barycentric weights the edge functions give.
+ * Triangles with no area draw nothing. Coordinates are expected within +-16384.
+ */
+template <class Sink>
+void color_triangle_halfspace(Sink& sink, int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3,
+                              const clip_rect& clip) {
+    // Twice the area, positive when the vertices are clockwise on screen
+    int area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+    if (area == 0) {
+        STAT_CULLED();
+        return;
+    }
+    if (area < 0) {
         swap(x2, x3); swap(y2, y3); swap(c2, c3);
+        area = -area;
     }
-    if (y1 == y2 && x1 > x2) {
-        swap(x1, x2); swap(y1, y2); swap(c1, c2);
+
+    // Pixels that may be written: the bounding box, inside the sink and the clip rectangle
+    clip_rect r;
+    r.x0 = max(max(min(x1, min(x2, x3)), clip.x0), 0);
+    r.y0 = max(max(min(y1, min(y2, y3)), clip.y0), 0);
+    r.x1 = min(min(max(x1, max(x2, x3)), clip.x1), sink.width - 1);
+    r.y1 = min(min(max(y1, max(y2, y3)), clip.y1), sink.height - 1);
+    if (r.x0 > r.x1 || r.y0 > r.y1) {
+        STAT_CULLED();
+        return;
+    }
+
+    // Each edge is opposite the vertex with the same number
+    edge_function edges[3] = {edge_function(x2, y2, x3, y3), edge_function(x3, y3, x1, y1), edge_function(x1, y1, x2, y2)};
+
+    // Color planes c(x, y) = c1 + dx * (x - x1) + dy * (y - y1), scaled to 0..255 with the rounding offset
+    vector3f dx = (c1 * edges[0].a + c2 * edges[1].a + c3 * edges[2].a) * (255.0f / area);
+    vector3f dy = (c1 * edges[0].b + c2 * edges[1].b + c3 * edges[2].b) * (255.0f / area);
+    vector3f base = c1 * 255 + vector3f(0.5f, 0.5f, 0.5f);
+    lanesf rampR = lanesf_ramp(dx.x), rampG = lanesf_ramp(dx.y), rampB = lanesf_ramp(dx.z);
+    lanes ramp[3] = {lanes_ramp(edges[0].a), lanes_ramp(edges[1].a), lanes_ramp(edges[2].a)};
+
+    for (int by = r.y0 & ~(BLOCK_SIZE - 1); by <= r.y1; by += BLOCK_SIZE) {
+        for (int bx = r.x0 & ~(BLOCK_SIZE - 1); bx <= r.x1; bx += BLOCK_SIZE) {
+            // The edge functions at the corners of the block tell if it is outside, inside or in between
+            bool outside, inside;
+            classify_block(edges, bx, by, outside, inside);
+            if (outside) continue;
+
+            // Blocks sticking out of the clip rectangle write only its columns
+            bool clipped = bx < r.x0 || bx + BLOCK_SIZE - 1 > r.x1;
+            lanes x = lanes_add(lanes_set(bx), lanes_ramp(1));
+            lanes columns = lanes_and(lanes_gt(x, lanes_set(r.x0 - 1)), lanes_gt(lanes_set(r.x1 + 1), x));
+
+            for (int y = max(by, r.y0); y <= min(by + BLOCK_SIZE - 1, r.y1); y++) {
+                lanes write = columns;
+                if (!inside) {
+                    write = lanes_and(write, row_coverage(edges, ramp, bx, y));
+                    if (lanes_mask(write) == 0) continue;
+                }
+
+                float ox = bx - x1, oy = y - y1;
+                lanes pixels = lanes_pack(lanesf_add(lanesf_set(base.x + dx.x * ox + dy.x * oy), rampR),
+                                          lanesf_add(lanesf_set(base.y + dx.y * ox + dy.y * oy), rampG),
+                                          lanesf_add(lanesf_set(base.z + dx.z * ox + dy.z * oy), rampB));
+                uint32_t* p = sink.row(y) + bx;
+                STAT_BLOCK_ROW(bx, y, lanes_mask(write));
+                if ((inside && !clipped) || lanes_mask(write) == 0xFF) lanes_store(p, pixels);
+                else lanes_store_masked(p, pixels, write);
+            }
+        }
     }
 }
+
+void color_triangle_halfspace(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Fall back to the scanline version, e.g. when the target is already locked
+        color_triangle(x1, y1, x2, y2, x3, y3, c1, c2, c3);
+        return;
+    }
+    color_triangle_halfspace(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3);
+    sink.unlock();
+}
+
+// ----------------------- Depth buffer ------------------------ //
+// Triangles come with a depth z per vertex, smaller being nearer, and a pixel is only written if
+// it is nearer than what was drawn there before. Depth after projection is linear on screen, so
+// it is interpolated with a plane like the colors were. The colors themselves are not: under
+// perspective they are linear in the scene, so c / w and 1 / w are interpolated on screen and
+// divided per pixel, w being the depth of the vertex before projection.
+// Next to the depth of every pixel the buffer keeps the nearest and the farthest depth of every
+// 8x8 block, and the farthest of every tile of 8x8 blocks. A triangle nearer than none of them
+// is dropped, a block where it is farther than everything is skipped without touching its
+// pixels, and a block where it is nearer than everything is written without testing them.
+
+const int DEPTH_TILE_BLOCKS = 8;    // A tile is 8x8 blocks, 64x64 pixels
+
+/**
+ * Depth of every pixel and the nearest and farthest depth of every block and tile.
+ * Rows are padded to whole blocks so that a block is always read with full vectors.
+ */
+struct depth_buffer {
+    int width, height;
+    int stride;                     // Floats between rows
+    int blocksX, blocksY, tilesX, tilesY;
+    vector<float> depth;
+    vector<float> blockNear, blockFar;
+    vector<float> tileFar;
+    vector<char> tileStale;         // A block in it changed since tileFar was taken
+
+    depth_buffer(int width, int height): width(width), height(height) {
+        blocksX = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        blocksY = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        tilesX = (blocksX + DEPTH_TILE_BLOCKS - 1) / DEPTH_TILE_BLOCKS;
+        tilesY = (blocksY + DEPTH_TILE_BLOCKS - 1) / DEPTH_TILE_BLOCKS;
+        stride = blocksX * BLOCK_SIZE;
+        depth.resize(stride * blocksY * BLOCK_SIZE);
+        blockNear.resize(blocksX * blocksY);
+        blockFar.resize(blocksX * blocksY);
+        tileFar.resize(tilesX * tilesY);
+        tileStale.resize(tilesX * tilesY);
+        clear();
+    }
+
+    /**
+     * Sets every pixel to the given depth, by default the far plane.
+     */
+    void clear(float far = 1.0f) {
+        fill(depth.begin(), depth.end(), far);
+        fill(blockNear.begin(), blockNear.end(), far);
+        fill(blockFar.begin(), blockFar.end(), far);
+        fill(tileFar.begin(), tileFar.end(), far);
+        fill(tileStale.begin(), tileStale.end(), 0);
+    }
+
+    float* row(int y) {
+        return &depth[y * stride];
+    }
+
+    // Takes the nearest and farthest depth of a block again after it was written
+    void update_block(int bx, int by) {
+        float nearest = depth[by * BLOCK_SIZE * stride + bx * BLOCK_SIZE], farthest = nearest;
+        for (int y = 0; y < BLOCK_SIZE; y++) {
+            const float* p = row(by * BLOCK_SIZE + y) + bx * BLOCK_SIZE;
+            for (int x = 0; x < BLOCK_SIZE; x++) {
+                nearest = min(nearest, p[x]);
+                farthest = max(farthest, p[x]);
+            }
+        }
+        blockNear[by * blocksX + bx] = nearest;
+        blockFar[by * blocksX + bx] = farthest;
+        tileStale[(by / DEPTH_TILE_BLOCKS) * tilesX + bx / DEPTH_TILE_BLOCKS] = 1;
+    }
+
+    float tile_far(int tx, int ty) {
+        int t = ty * tilesX + tx;
+        if (tileStale[t]) {
+            float farthest = -INFINITY;
+            for (int by = ty * DEPTH_TILE_BLOCKS; by < min((ty + 1) * DEPTH_TILE_BLOCKS, blocksY); by++) {
+                for (int bx = tx * DEPTH_TILE_BLOCKS; bx < min((tx + 1) * DEPTH_TILE_BLOCKS, blocksX); bx++) {
+                    farthest = max(farthest, blockFar[by * blocksX + bx]);
+                }
+            }
+            tileFar[t] = farthest;
+            tileStale[t] = 0;
+        }
+        return tileFar[t];
+    }
+};
+
+/**
+ * Draws a triangle with a depth test into a memory sink with the same size as the depth buffer.
+ * p1..p3 are the vertices on screen with their depth in z; w1..w3 their depth before projection,
+ * which only matters for the colors. Pixels are the ones color_triangle_halfspace draws.
+ */
+template <class Sink>
+void color_triangle_depth(Sink& sink, depth_buffer& depth, vector3f p1, vector3f p2, vector3f p3, float w1, float w2, float w3,
+                          vector3f c1, vector3f c2, vector3f c3, const clip_rect& clip) {
+    int x1 = lrintf(p1.x), y1 = lrintf(p1.y);
+    int x2 = lrintf(p2.x), y2 = lrintf(p2.y);
+    int x3 = lrintf(p3.x), y3 = lrintf(p3.y);
+
+    // Twice the area, positive when the vertices are clockwise on screen
+    int area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+    if (area == 0) {
+        STAT_CULLED();
+        return;
+    }
+    if (area < 0) {
+        swap(x2, x3); swap(y2, y3);
+        swap(p2, p3); swap(w2, w3); swap(c2, c3);
+        area = -area;
+    }
+
+    clip_rect r;
+    r.x0 = max(max(min(x1, min(x2, x3)), clip.x0), 0);
+    r.y0 = max(max(min(y1, min(y2, y3)), clip.y0), 0);
+    r.x1 = min(min(max(x1, max(x2, x3)), clip.x1), min(sink.width, depth.width) - 1);
+    r.y1 = min(min(max(y1, max(y2, y3)), clip.y1), min(sink.height, depth.height) - 1);
+    if (r.x0 > r.x1 || r.y0 > r.y1) {
+        STAT_CULLED();
+        return;
+    }
+
+    // Dropped at once if it is behind everything in the tiles it covers
+    float zNearest = min(p1.z, min(p2.z, p3.z)), zFarthest = max(p1.z, max(p2.z, p3.z));
+    bool hidden = true;
+    for (int ty = r.y0 / (BLOCK_SIZE * DEPTH_TILE_BLOCKS); hidden && ty <= r.y1 / (BLOCK_SIZE * DEPTH_TILE_BLOCKS); ty++) {
+        for (int tx = r.x0 / (BLOCK_SIZE * DEPTH_TILE_BLOCKS); hidden && tx <= r.x1 / (BLOCK_SIZE * DEPTH_TILE_BLOCKS); tx++) {
+            if (zNearest < depth.tile_far(tx, ty)) hidden = false;
+        }
+    }
+    if (hidden) {
+        STAT_CULLED();
+        return;
+    }
+
+    edge_function edges[3] = {edge_function(x2, y2, x3, y3), edge_function(x3, y3, x1, y1), edge_function(x1, y1, x2, y2)};
+
+    // Planes f(x, y) = f1 + dx * (x - x1) + dy * (y - y1) through the three values of each vertex
+    struct plane {
+        float base, dx, dy;
+        plane(const edge_function* e, float v1, float v2, float v3, float area) {
+            base = v1;
+            dx = (v1 * e[0].a + v2 * e[1].a + v3 * e[2].a) / area;
+            dy = (v1 * e[0].b + v2 * e[1].b + v3 * e[2].b) / area;
+        }
+        float at(float ox, float oy) const {
+            return base + dx * ox + dy * oy;
+        }
+    };
+    float q1 = 1 / w1, q2 = 1 / w2, q3 = 1 / w3;
+    plane z(edges, p1.z, p2.z, p3.z, area), q(edges, q1, q2, q3, area);
+    plane red(edges, c1.x * q1, c2.x * q2, c3.x * q3, area);
+    plane green(edges, c1.y * q1, c2.y * q2, c3.y * q3, area);
+    plane blue(edges, c1.z * q1, c2.z * q2, c3.z * q3, area);
+    lanesf rampZ = lanesf_ramp(z.dx), rampQ = lanesf_ramp(q.dx);
+    lanesf rampR = lanesf_ramp(red.dx), rampG = lanesf_ramp(green.dx), rampB = lanesf_ramp(blue.dx);
+    lanesf scale = lanesf_set(255), half = lanesf_set(0.5f);
+    lanes ramp[3] = {lanes_ramp(edges[0].a), lanes_ramp(edges[1].a), lanes_ramp(edges[2].a)};
+
+    for (int by = r.y0 & ~(BLOCK_SIZE - 1); by <= r.y1; by += BLOCK_SIZE) {
+        for (int bx = r.x0 & ~(BLOCK_SIZE - 1); bx <= r.x1; bx += BLOCK_SIZE) {
+            bool outside, inside;
+            classify_block(edges, bx, by, outside, inside);
+            if (outside) continue;
+
+            // The depth of the triangle over the block, from its corners and kept within the triangle
+            float ox = bx - x1, oy = by - y1;
+            float zCorner = z.at(ox, oy);
+            float zLow = zCorner + min(z.dx, 0.0f) * (BLOCK_SIZE - 1) + min(z.dy, 0.0f) * (BLOCK_SIZE - 1);
+            float zHigh = zCorner + max(z.dx, 0.0f) * (BLOCK_SIZE - 1) + max(z.dy, 0.0f) * (BLOCK_SIZE - 1);
+            int block = (by / BLOCK_SIZE) * depth.blocksX + bx / BLOCK_SIZE;
+            if (max(zLow, zNearest) >= depth.blockFar[block]) continue;
+            bool nearer = min(zHigh, zFarthest) < depth.blockNear[block];
+
+            bool clipped = bx < r.x0 || bx + BLOCK_SIZE - 1 > r.x1;
+            lanes x = lanes_add(lanes_set(bx), lanes_ramp(1));
+            lanes columns = lanes_and(lanes_gt(x, lanes_set(r.x0 - 1)), lanes_gt(lanes_set(r.x1 + 1), x));
+
+            bool written = false;
+            for (int y = max(by, r.y0); y <= min(by + BLOCK_SIZE - 1, r.y1); y++) {
+                lanes write = columns;
+                if (!inside) {
+                    write = lanes_and(write, row_coverage(edges, ramp, bx, y));
+                }
+                oy = y - y1;
+                float* d = depth.row(y) + bx;
+                lanesf zs = lanesf_add(lanesf_set(z.at(ox, oy)), rampZ);
+                if (!nearer) write = lanes_and(write, lanesf_lt(zs, lanesf_load(d)));
+                int mask = lanes_mask(write);
+                if (mask == 0) continue;
+                written = true;
+
+                lanesf inverse = lanesf_div(scale, lanesf_add(lanesf_set(q.at(ox, oy)), rampQ));
+                lanes pixels = lanes_pack(lanesf_add(lanesf_mul(lanesf_add(lanesf_set(red.at(ox, oy)), rampR), inverse), half),
+                                          lanesf_add(lanesf_mul(lanesf_add(lanesf_set(green.at(ox, oy)), rampG), inverse), half),
+                                          lanesf_add(lanesf_mul(lanesf_add(lanesf_set(blue.at(ox, oy)), rampB), inverse), half));
+                uint32_t* p = sink.row(y) + bx;
+                STAT_BLOCK_ROW(bx, y, mask);
+                if ((inside && nearer && !clipped) || mask == 0xFF) {
+                    lanes_store(p, pixels);
+                    lanesf_store(d, zs);
+                } else {
+                    lanes_store_masked(p, pixels, write);
+                    lanesf_store_masked(d, zs, write);
+                }
+            }
+            if (written) depth.update_block(bx / BLOCK_SIZE, by / BLOCK_SIZE);
+        }
+    }
+}
+
+void color_triangle_depth(depth_buffer& depth, vector3f p1, vector3f p2, vector3f p3, float w1, float w2, float w3,
+                          vector3f c1, vector3f c2, vector3f c3) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // The depth test writes whole block rows, so into a copy when the target is already locked
+        copied_target_sink target;
+        color_triangle_depth(target, depth, p1, p2, p3, w1, w2, w3, c1, c2, c3);
+        target.store();
+        return;
+    }
+    color_triangle_depth(sink, depth, p1, p2, p3, w1, w2, w3, c1, c2, c3);
+    sink.unlock();
+}
+
+// ----------------------- Textures ------------------------ //
+// Textures are kept as a chain of mip levels, each half the size of the one before, down to 1x1.
+// The texels of a level are stored in Z order (Morton order): the bits of x and y are interleaved
+// into the index, so texels close to each other in any direction are close in memory, and walking
+// a rotated triangle touches about as many cache lines as walking an upright one. The index is the
+// OR of two per-level tables, one for x and one for y, which hold the spread bits.
+// A pixel samples the level that matches how many texels it covers on screen, found from the
+// derivatives of u and v; trilinear filtering blends the two nearest levels.
+
+// Moves bit i of v to bit 2i
+inline uint32_t spread_bits(uint32_t v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Blends two packed pixels, f from 0 (all a) to 256 (all b), two channels at a time
+inline uint32_t lerp_texels(uint32_t a, uint32_t b, uint32_t f) {
+    uint32_t rb = (((a & 0xFF00FF) * (256 - f) + (b & 0xFF00FF) * f) >> 8) & 0xFF00FF;
+    uint32_t ga = (((a >> 8) & 0xFF00FF) * (256 - f) + ((b >> 8) & 0xFF00FF) * f) & 0xFF00FF00;
+    return rb | ga;
+}
+
+/**
+ * A mip-mapped texture of packed 0xAABBGGRR texels. Width and height must be powers of two.
+ * Texture coordinates go from 0 to 1 over the texture and repeat outside.
+ */
+struct texture {
+    struct level {
+        int width, height;
+        vector<uint32_t> texels;            // In Z order
+        vector<uint32_t> xIndex, yIndex;    // Index of a texel is xIndex[x] | yIndex[y]
+
+        uint32_t at(int x, int y) const {
+            return texels[xIndex[x & (width - 1)] | yIndex[y & (height - 1)]];
+        }
+    };
+    vector<level> levels;
+
+    /**
+     * Copies row-major pixels into Z order and builds the mip chain with a 2x2 box filter.
+     */
+    texture(const uint32_t* pixels, int width, int height) {
+        vector<uint32_t> rows(pixels, pixels + width * height);
+        while (true) {
+            levels.push_back(make_level(rows, width, height));
+            if (width == 1 && height == 1) break;
+            int w = max(width / 2, 1), h = max(height / 2, 1);
+            vector<uint32_t> smaller(w * h);
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    int x0 = min(2 * x, width - 1), x1 = min(2 * x + 1, width - 1);
+                    int y0 = min(2 * y, height - 1), y1 = min(2 * y + 1, height - 1);
+                    uint32_t a = rows[y0 * width + x0], b = rows[y0 * width + x1];
+                    uint32_t c = rows[y1 * width + x0], d = rows[y1 * width + x1];
+                    uint32_t texel = 0;
+                    for (int shift = 0; shift < 32; shift += 8) {
+                        uint32_t sum = ((a >> shift) & 0xFF) + ((b >> shift) & 0xFF) + ((c >> shift) & 0xFF) + ((d >> shift) & 0xFF);
+                        texel |= ((sum + 2) / 4) << shift;
+                    }
+                    smaller[y * w + x] = texel;
+                }
+            }
+            rows.swap(smaller);
+            width = w;
+            height = h;
+        }
+    }
+
+    static level make_level(const vector<uint32_t>& rows, int width, int height) {
+        level l;
+        l.width = width;
+        l.height = height;
+        // Square levels interleave all bits; on longer sides the bits past the shorter side go on top
+        int bits = 0;
+        while ((2 << bits) <= min(width, height)) bits++;
+        int square = 1 << bits;
+        l.xIndex.resize(width);
+        l.yIndex.resize(height);
+        for (int x = 0; x < width; x++) l.xIndex[x] = spread_bits(x % square) | (x / square) << (2 * bits);
+        for (int y = 0; y < height; y++) l.yIndex[y] = (spread_bits(y % square) << 1) | (y / square) << (2 * bits);
+        l.texels.resize(width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) l.texels[l.xIndex[x] | l.yIndex[y]] = rows[y * width + x];
+        }
+        return l;
+    }
+
+    // Bilinear sample of one level, with texel centers at half-integer coordinates
+    uint32_t bilinear(int lod, float u, float v) const {
+        const level& l = levels[lod];
+        float x = u * l.width - 0.5f, y = v * l.height - 0.5f;
+        float fx = floorf(x), fy = floorf(y);
+        int x0 = (int)fx, y0 = (int)fy;
+        uint32_t wx = (uint32_t)((x - fx) * 256), wy = (uint32_t)((y - fy) * 256);
+        return lerp_texels(lerp_texels(l.at(x0, y0), l.at(x0 + 1, y0), wx),
+                           lerp_texels(l.at(x0, y0 + 1), l.at(x0 + 1, y0 + 1), wx), wy);
+    }
+
+    /**
+     * Samples at (u, v). lod is the base 2 logarithm of how many texels of the largest level a pixel covers.
+     */
+    uint32_t sample(float u, float v, float lod, texture_filter filter) const {
+        int last = levels.size() - 1;
+        lod = min(max(lod, 0.0f), (float)last);
+        if (filter == TEXTURE_BILINEAR || last == 0) return bilinear((int)(lod + 0.5f), u, v);
+        int lower = min((int)lod, last - 1);
+        uint32_t f = (uint32_t)((lod - lower) * 256);
+        if (f == 0) return bilinear(lower, u, v);
+        return lerp_texels(bilinear(lower, u, v), bilinear(lower + 1, u, v), f);
+    }
+};
+
+/**
+ * Draws a textured triangle into a memory sink with the half-space rasterizer.
+ * t1..t3 are the texture coordinates of the vertices in x and y, and w1..w3 their depth before
+ * projection, so that the texture is mapped with perspective. Pixels are the ones
+ * color_triangle_halfspace draws.
+ */
+template <class Sink>
+void texture_triangle(Sink& sink, const texture& tex, int x1, int y1, int x2, int y2, int x3, int y3, float w1, float w2, float w3,
+                      vector3f t1, vector3f t2, vector3f t3, texture_filter filter, const clip_rect& clip) {
+    int area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+    if (area == 0) {
+        STAT_CULLED();
+        return;
+    }
+    if (area < 0) {
+        swap(x2, x3); swap(y2, y3);
+        swap(w2, w3); swap(t2, t3);
+        area = -area;
+    }
+
+    clip_rect r;
+    r.x0 = max(max(min(x1, min(x2, x3)), clip.x0), 0);
+    r.y0 = max(max(min(y1, min(y2, y3)), clip.y0), 0);
+    r.x1 = min(min(max(x1, max(x2, x3)), clip.x1), sink.width - 1);
+    r.y1 = min(min(max(y1, max(y2, y3)), clip.y1), sink.height - 1);
+    if (r.x0 > r.x1 || r.y0 > r.y1) {
+        STAT_CULLED();
+        return;
+    }
+
+    edge_function edges[3] = {edge_function(x2, y2, x3, y3), edge_function(x3, y3, x1, y1), edge_function(x1, y1, x2, y2)};
+    lanes ramp[3] = {lanes_ramp(edges[0].a), lanes_ramp(edges[1].a), lanes_ramp(edges[2].a)};
+
+    // 1 / w, u / w and v / w are linear on screen: planes f(x, y) = f1 + dx * (x - x1) + dy * (y - y1)
+    float q1 = 1 / w1, q2 = 1 / w2, q3 = 1 / w3;
+    float values[3][3] = {{q1, q2, q3}, {t1.x * q1, t2.x * q2, t3.x * q3}, {t1.y * q1, t2.y * q2, t3.y * q3}};
+    float base[3], dx[3], dy[3];
+    for (int i = 0; i < 3; i++) {
+        base[i] = values[i][0];
+        dx[i] = (values[i][0] * edges[0].a + values[i][1] * edges[1].a + values[i][2] * edges[2].a) / area;
+        dy[i] = (values[i][0] * edges[0].b + values[i][1] * edges[1].b + values[i][2] * edges[2].b) / area;
+    }
+    float width = tex.levels[0].width, height = tex.levels[0].height;
+
+    for (int by = r.y0 & ~(BLOCK_SIZE - 1); by <= r.y1; by += BLOCK_SIZE) {
+        for (int bx = r.x0 & ~(BLOCK_SIZE - 1); bx <= r.x1; bx += BLOCK_SIZE) {
+            bool outside, inside;
+            classify_block(edges, bx, by, outside, inside);
+            if (outside) continue;
+
+            lanes x = lanes_add(lanes_set(bx), lanes_ramp(1));
+            lanes columns = lanes_and(lanes_gt(x, lanes_set(r.x0 - 1)), lanes_gt(lanes_set(r.x1 + 1), x));
+
+            for (int y = max(by, r.y0); y <= min(by + BLOCK_SIZE - 1, r.y1); y++) {
+                lanes write = columns;
+                if (!inside) write = lanes_and(write, row_coverage(edges, ramp, bx, y));
+                uint32_t* p = sink.row(y);
+                STAT_BLOCK_ROW(bx, y, lanes_mask(write));
+                for (int m = lanes_mask(write); m; m &= m - 1) {
+                    int px = bx + __builtin_ctz(m);
+                    float ox = px - x1, oy = y - y1;
+                    float q = base[0] + dx[0] * ox + dy[0] * oy, w = 1 / q;
+                    float u = (base[1] + dx[1] * ox + dy[1] * oy) * w;
+                    float v = (base[2] + dx[2] * ox + dy[2] * oy) * w;
+                    // Derivatives of u and v on screen, in texels of the largest level
+                    float dudx = (dx[1] - u * dx[0]) * w * width, dvdx = (dx[2] - v * dx[0]) * w * height;
+                    float dudy = (dy[1] - u * dy[0]) * w * width, dvdy = (dy[2] - v * dy[0]) * w * height;
+                    float rho = max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+                    p[px] = tex.sample(u, v, 0.5f * log2f(rho), filter);
+                }
+            }
+        }
+    }
+}
+
+void texture_triangle(const texture& tex, int x1, int y1, int x2, int y2, int x3, int y3, float w1, float w2, float w3,
+                      vector3f t1, vector3f t2, vector3f t3, texture_filter filter) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Into a copy when the target is already locked
+        copied_target_sink target;
+        texture_triangle(target, tex, x1, y1, x2, y2, x3, y3, w1, w2, w3, t1, t2, t3, filter);
+        target.store();
+        return;
+    }
+    texture_triangle(sink, tex, x1, y1, x2, y2, x3, y3, w1, w2, w3, t1, t2, t3, filter);
+    sink.unlock();
+}
+
+// ----------------------- Attribute streams ------------------------ //
+// Instead of a vector3f color per vertex, a mesh can carry any number of varyings: floats that are
+// interpolated over each triangle, like color channels or texture coordinates. They are kept as a
+// structure of arrays, one aligned stream per varying. Each row of an 8x8 block interpolates every
+// varying for its eight pixels with one vector add, into a small buffer laid out the same way,
+// and a shader turns that buffer into pixels. So the cost per pixel grows with the number of
+// varyings and nothing else.
+
+/**
+ * The vertices of a mesh as a structure of arrays: a stream of x, a stream of y and one stream per
+ * varying, each starting on a 32-byte boundary.
+ */
+struct vertex_streams {
+    int vertexCount, varyingCount;
+    int stride;             // Floats from one stream to the next, a multiple of 8
+    vector<float> storage;
+
+    vertex_streams(int vertexCount, int varyingCount): vertexCount(vertexCount), varyingCount(varyingCount) {
+        stride = (vertexCount + 7) & ~7;
+        storage.resize(stride * (varyingCount + 2) + 8);
+    }
+
+    float* x()              { return data(); }
+    float* y()              { return data() + stride; }
+    float* varying(int k)   { return data() + (k + 2) * stride; }
+    const float* x() const              { return data(); }
+    const float* y() const              { return data() + stride; }
+    const float* varying(int k) const   { return data() + (k + 2) * stride; }
+
+private:
+    // The vector's memory rounded up to 32 bytes, computed every time so that copies stay valid
+    float* data() const {
+        uintptr_t p = (uintptr_t)storage.data();
+        return (float*)((p + 31) & ~(uintptr_t)31);
+    }
+};
+
+/**
+ * Shader for streams whose first three varyings are red, green and blue from 0 to 1.
+ * A shader gets the varyings of the eight pixels of a block row, varying k of pixel i being
+ * varyings[8 * k + i], and returns the packed pixels.
+ */
+struct color_shader {
+    lanes operator()(const float* varyings) const {
+        lanesf scale = lanesf_set(255), half = lanesf_set(0.5f);
+        return lanes_pack(lanesf_add(lanesf_mul(lanesf_load(varyings), scale), half),
+                          lanesf_add(lanesf_mul(lanesf_load(varyings + BLOCK_SIZE), scale), half),
+                          lanesf_add(lanesf_mul(lanesf_load(varyings + 2 * BLOCK_SIZE), scale), half));
+    }
+};
+
+/**
+ * Draws count triangles of a mesh into a memory sink with the half-space rasterizer; triangle i
+ * uses the vertices indices[3 * i] to indices[3 * i + 2]. Positions are rounded to whole pixels,
+ * so pixels are the ones color_triangle_halfspace draws.
+ */
+template <class Sink, class Shader>
+void shade_triangles(Sink& sink, const vertex_streams& vertices, const int* indices, int count, const Shader& shader,
+                     const clip_rect& clip) {
+    int varyings = vertices.varyingCount;
+    // Per triangle: the plane of each varying and its steps along a block row
+    vector<float> base(varyings), dx(varyings), dy(varyings), ramps(varyings * BLOCK_SIZE);
+    // Per block row: every varying for its eight pixels
+    vector<float> row(varyings * BLOCK_SIZE);
+
+    for (int t = 0; t < count; t++) {
+        int i1 = indices[3 * t], i2 = indices[3 * t + 1], i3 = indices[3 * t + 2];
+        int x1 = lrintf(vertices.x()[i1]), y1 = lrintf(vertices.y()[i1]);
+        int x2 = lrintf(vertices.x()[i2]), y2 = lrintf(vertices.y()[i2]);
+        int x3 = lrintf(vertices.x()[i3]), y3 = lrintf(vertices.y()[i3]);
+        int area = (x2 - x1) * (y3 - y1) - (y2 - y1) * (x3 - x1);
+        if (area == 0) {
+            STAT_CULLED();
+            continue;
+        }
+        if (area < 0) {
+            swap(x2, x3); swap(y2, y3); swap(i2, i3);
+            area = -area;
+        }
+
+        clip_rect r;
+        r.x0 = max(max(min(x1, min(x2, x3)), clip.x0), 0);
+        r.y0 = max(max(min(y1, min(y2, y3)), clip.y0), 0);
+        r.x1 = min(min(max(x1, max(x2, x3)), clip.x1), sink.width - 1);
+        r.y1 = min(min(max(y1, max(y2, y3)), clip.y1), sink.height - 1);
+        if (r.x0 > r.x1 || r.y0 > r.y1) {
+            STAT_CULLED();
+            continue;
+        }
+
+        edge_function edges[3] = {edge_function(x2, y2, x3, y3), edge_function(x3, y3, x1, y1), edge_function(x1, y1, x2, y2)};
+        lanes ramp[3] = {lanes_ramp(edges[0].a), lanes_ramp(edges[1].a), lanes_ramp(edges[2].a)};
+        for (int k = 0; k < varyings; k++) {
+            const float* v = vertices.varying(k);
+            base[k] = v[i1];
+            dx[k] = (v[i1] * edges[0].a + v[i2] * edges[1].a + v[i3] * edges[2].a) / area;
+            dy[k] = (v[i1] * edges[0].b + v[i2] * edges[1].b + v[i3] * edges[2].b) / area;
+            lanesf_store(&ramps[k * BLOCK_SIZE], lanesf_ramp(dx[k]));
+        }
+
+        for (int by = r.y0 & ~(BLOCK_SIZE - 1); by <= r.y1; by += BLOCK_SIZE) {
+            for (int bx = r.x0 & ~(BLOCK_SIZE - 1); bx <= r.x1; bx += BLOCK_SIZE) {
+                bool outside, inside;
+                classify_block(edges, bx, by, outside, inside);
+                if (outside) continue;
+
+                bool clipped = bx < r.x0 || bx + BLOCK_SIZE - 1 > r.x1;
+                lanes x = lanes_add(lanes_set(bx), lanes_ramp(1));
+                lanes columns = lanes_and(lanes_gt(x, lanes_set(r.x0 - 1)), lanes_gt(lanes_set(r.x1 + 1), x));
+
+                for (int y = max(by, r.y0); y <= min(by + BLOCK_SIZE - 1, r.y1); y++) {
+                    lanes write = columns;
+                    if (!inside) {
+                        write = lanes_and(write, row_coverage(edges, ramp, bx, y));
+                        if (lanes_mask(write) == 0) continue;
+                    }
+
+                    float ox = bx - x1, oy = y - y1;
+                    for (int k = 0; k < varyings; k++) {
+                        lanesf_store(&row[k * BLOCK_SIZE], lanesf_add(lanesf_set(base[k] + dx[k] * ox + dy[k] * oy),
+                                                                      lanesf_load(&ramps[k * BLOCK_SIZE])));
+                    }
+                    lanes pixels = shader(row.data());
+                    uint32_t* p = sink.row(y) + bx;
+                    STAT_BLOCK_ROW(bx, y, lanes_mask(write));
+                    if ((inside && !clipped) || lanes_mask(write) == 0xFF) lanes_store(p, pixels);
+                    else lanes_store_masked(p, pixels, write);
+                }
+            }
+        }
+    }
+}
+
+void shade_triangles(const vertex_streams& vertices, const int* indices, int count) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Into a copy when the target is already locked
+        copied_target_sink target;
+        shade_triangles(target, vertices, indices, count, color_shader());
+        target.store();
+        return;
+    }
+    shade_triangles(sink, vertices, indices, count, color_shader());
+    sink.unlock();
+}
+
+// ----------------------- Antialiasing ------------------------ //
+// Each pixel is tested at 4 or 8 sample points instead of one, giving a mask of the samples inside
+// the triangle. The edge tests run on eight pixels at once, one sample position at a time. The
+// color is still computed once per pixel, and a partly covered pixel is blended with what is
+// already there by the fraction of samples covered, like the lines of wu_line. Pixels covered by
+// all samples are written as usual. Being a blend, two triangles sharing an edge let a little of
+// the background through along it; meshes drawn without antialiasing do not have that.
+// Vertices are snapped to 1/16 pixel, and the sample points lie on that grid too, so that the top
+// and left edge rule applies to samples exactly as it does to pixels.
+
+// Sample points around the pixel in 1/16 pixel: a rotated grid for 4, the usual pattern for 8
+const int AA_PATTERN_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+const int AA_PATTERN_8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+const int AA_REACH = 7;     // Farthest a sample lies from the pixel, in 1/16 pixel
+
+/**
+ * Draws an antialiased triangle with color gradient into a memory sink, with 4 or 8 samples per
+ * pixel. Triangles are expected to be less than 2048 pixels across.
+ */
+template <class Sink>
+void color_triangle_aa(Sink& sink, float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3,
+                       int samples, const clip_rect& clip) {
+    const int (*pattern)[2] = samples == 8 ? AA_PATTERN_8 : AA_PATTERN_4;
+    samples = samples == 8 ? 8 : 4;
+    int X1 = to_subpixel(x1), Y1 = to_subpixel(y1);
+    int X2 = to_subpixel(x2), Y2 = to_subpixel(y2);
+    int X3 = to_subpixel(x3), Y3 = to_subpixel(y3);
+
+    // Twice the area, positive when the vertices are clockwise on screen
+    int64_t area = (int64_t)(X2 - X1) * (Y3 - Y1) - (int64_t)(Y2 - Y1) * (X3 - X1);
+    if (area == 0) {
+        STAT_CULLED();
+        return;
+    }
+    if (area < 0) {
+        swap(X2, X3); swap(Y2, Y3); swap(c2, c3);
+    }
+
+    // Pixels with a sample point inside the bounding box
+    clip_rect r;
+    r.x0 = max(max(subpixel_ceil(min(X1, min(X2, X3)) - AA_REACH), clip.x0), 0);
+    r.y0 = max(max(subpixel_ceil(min(Y1, min(Y2, Y3)) - AA_REACH), clip.y0), 0);
+    r.x1 = min(min((int)floor_div(max(X1, max(X2, X3)) + AA_REACH, SUBPIXEL_ONE), clip.x1), sink.width - 1);
+    r.y1 = min(min((int)floor_div(max(Y1, max(Y2, Y3)) + AA_REACH, SUBPIXEL_ONE), clip.y1), sink.height - 1);
+    if (r.x0 > r.x1 || r.y0 > r.y1) {
+        STAT_CULLED();
+        return;
+    }
+
+    // Edge functions in 1/16 pixel, relative to the corner of the first block so that they fit in 32 bits
+    int originX = (r.x0 & ~(BLOCK_SIZE - 1)) * SUBPIXEL_ONE, originY = (r.y0 & ~(BLOCK_SIZE - 1)) * SUBPIXEL_ONE;
+    edge_function edges[3] = {edge_function(X2 - originX, Y2 - originY, X3 - originX, Y3 - originY),
+                              edge_function(X3 - originX, Y3 - originY, X1 - originX, Y1 - originY),
+                              edge_function(X1 - originX, Y1 - originY, X2 - originX, Y2 - originY)};
+    lanes ramp[3];
+    int32_t offset[3][8];       // Of each sample from the pixel, per edge
+    for (int e = 0; e < 3; e++) {
+        ramp[e] = lanes_ramp(edges[e].a * SUBPIXEL_ONE);
+        for (int i = 0; i < samples; i++) offset[e][i] = edges[e].a * pattern[i][0] + edges[e].b * pattern[i][1];
+    }
+    int full = (1 << samples) - 1;
+
+    // Color planes in pixels, scaled to 0..255 with the rounding offset
+    float fx1 = X1 / (float)SUBPIXEL_ONE, fy1 = Y1 / (float)SUBPIXEL_ONE;
+    float ex2 = (X2 - X1) / (float)SUBPIXEL_ONE, ey2 = (Y2 - Y1) / (float)SUBPIXEL_ONE;
+    float ex3 = (X3 - X1) / (float)SUBPIXEL_ONE, ey3 = (Y3 - Y1) / (float)SUBPIXEL_ONE;
+    float scale = 255 / (ex2 * ey3 - ey2 * ex3);
+    vector3f dx = ((c2 - c1) * ey3 - (c3 - c1) * ey2) * scale;
+    vector3f dy = ((c3 - c1) * ex2 - (c2 - c1) * ex3) * scale;
+    vector3f base = c1 * 255 + vector3f(0.5f, 0.5f, 0.5f);
+    lanesf rampR = lanesf_ramp(dx.x), rampG = lanesf_ramp(dx.y), rampB = lanesf_ramp(dx.z);
+
+    // Reach of the samples of a block from its first pixel, in 1/16 pixel
+    const int low = -AA_REACH, high = (BLOCK_SIZE - 1) * SUBPIXEL_ONE + AA_REACH;
+    for (int by = r.y0 & ~(BLOCK_SIZE - 1); by <= r.y1; by += BLOCK_SIZE) {
+        for (int bx = r.x0 & ~(BLOCK_SIZE - 1); bx <= r.x1; bx += BLOCK_SIZE) {
+            int sx = bx * SUBPIXEL_ONE - originX, sy = by * SUBPIXEL_ONE - originY;
+            bool outside = false, inside = true;
+            for (int e = 0; e < 3; e++) {
+                const edge_function& f = edges[e];
+                int32_t least = f.at(sx, sy) + f.a * (f.a < 0 ? high : low) + f.b * (f.b < 0 ? high : low);
+                int32_t most = f.at(sx, sy) + f.a * (f.a < 0 ? low : high) + f.b * (f.b < 0 ? low : high);
+                if (most < 0) outside = true;
+                if (least < 0) inside = false;
+            }
+            if (outside) continue;
+
+            bool clipped = bx < r.x0 || bx + BLOCK_SIZE - 1 > r.x1;
+            lanes x = lanes_add(lanes_set(bx), lanes_ramp(1));
+            lanes columns = lanes_and(lanes_gt(x, lanes_set(r.x0 - 1)), lanes_gt(lanes_set(r.x1 + 1), x));
+
+            for (int y = max(by, r.y0); y <= min(by + BLOCK_SIZE - 1, r.y1); y++) {
+                // One bit per sample inside all three edges
+                lanes coverage = lanes_set(full);
+                if (!inside) {
+                    int32_t rowStart[3];
+                    for (int e = 0; e < 3; e++) rowStart[e] = edges[e].at(sx, y * SUBPIXEL_ONE - originY);
+                    coverage = lanes_set(0);
+                    for (int i = 0; i < samples; i++) {
+                        lanes w = lanes_or(lanes_or(lanes_add(lanes_set(rowStart[0] + offset[0][i]), ramp[0]),
+                                                    lanes_add(lanes_set(rowStart[1] + offset[1][i]), ramp[1])),
+                                           lanes_add(lanes_set(rowStart[2] + offset[2][i]), ramp[2]));
+                        coverage = lanes_or(coverage, lanes_and(lanes_gt(w, lanes_set(-1)), lanes_set(1 << i)));
+                    }
+                }
+                if (clipped) coverage = lanes_and(coverage, columns);
+                int covered = lanes_mask(lanes_gt(coverage, lanes_set(0)));
+                if (covered == 0) continue;
+                int whole = lanes_mask(lanes_gt(coverage, lanes_set(full - 1)));
+
+                float ox = bx - fx1, oy = y - fy1;
+                lanes pixels = lanes_pack(lanesf_add(lanesf_set(base.x + dx.x * ox + dy.x * oy), rampR),
+                                          lanesf_add(lanesf_set(base.y + dx.y * ox + dy.y * oy), rampG),
+                                          lanesf_add(lanesf_set(base.z + dx.z * ox + dy.z * oy), rampB));
+                uint32_t* p = sink.row(y) + bx;
+                STAT_BLOCK_ROW(bx, y, covered);
+                if (whole == 0xFF) {
+                    lanes_store(p, pixels);
+                    continue;
+                }
+                alignas(32) uint32_t mask[BLOCK_SIZE], color[BLOCK_SIZE];
+                lanes_store(mask, coverage);
+                lanes_store(color, pixels);
+                for (int m = covered; m; m &= m - 1) {
+                    int i = __builtin_ctz(m);
+                    if (whole & (1 << i)) p[i] = color[i];
+                    else p[i] = lerp_texels(p[i], color[i], __builtin_popcount(mask[i]) * 256 / samples);
+                }
+            }
+        }
+    }
+}
+
+void color_triangle_aa(float x1, float y1, float x2, float y2, float x3, float y3, vector3f c1, vector3f c2, vector3f c3, int samples) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Blending reads the target, so into a copy when it is already locked
+        copied_target_sink target;
+        color_triangle_aa(target, x1, y1, x2, y2, x3, y3, c1, c2, c3, samples);
+        target.store();
+        return;
+    }
+    color_triangle_aa(sink, x1, y1, x2, y2, x3, y3, c1, c2, c3, samples);
+    sink.unlock();
+}
+
+// ----------------------- Clip-space pipeline ------------------------ //
+// Takes triangles as a vertex shader leaves them, in homogeneous clip space where the view volume
+// is -w <= x, y, z <= w, and draws them with a depth test. Nearly all triangles lie on screen or
+// only cross its edges; those are projected as they are and the rasterizer's scissor rectangle
+// cuts them down. Clipping the polygon is only needed where projecting goes wrong: behind the
+// near plane, where w turns negative, and so far off screen that the coordinates outgrow the
+// rasterizer. The latter is pushed out to a guard band around the screen, so only triangles that
+// are both long and close to the camera go through Sutherland-Hodgman.
+
+const int GUARD_BAND = 4096;    // Pixels around the screen, within the +-16384 of the half-space rasterizers
+
+// Outcode bits: the planes of the view volume, then the guard band around the screen
+const int CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_TOP = 4, CLIP_BOTTOM = 8, CLIP_NEAR = 16, CLIP_FAR = 32;
+const int GUARD_LEFT = 64, GUARD_RIGHT = 128, GUARD_TOP = 256, GUARD_BOTTOM = 512;
+const int CLIPPED_PLANES = CLIP_NEAR | GUARD_LEFT | GUARD_RIGHT | GUARD_TOP | GUARD_BOTTOM;
+
+// A vertex in clip space with its color
+struct clip_vertex {
+    float x, y, z, w;
+    vector3f color;
+
+    clip_vertex(): x(0), y(0), z(0), w(1), color(0, 0) {};
+    clip_vertex(float x, float y, float z, float w, vector3f color): x(x), y(y), z(z), w(w), color(color) {};
+};
+
+/**
+ * The guard band in clip space: a vertex is inside while |x| <= gx * w and |y| <= gy * w.
+ */
+struct guard_band {
+    float gx, gy;
+
+    guard_band(int width, int height) {
+        gx = 1 + 2.0f * GUARD_BAND / width;
+        gy = 1 + 2.0f * GUARD_BAND / height;
+    }
+
+    int outcode(const clip_vertex& v) const {
+        int code = 0;
+        if (v.x < -v.w) code |= CLIP_LEFT;
+        if (v.x > v.w) code |= CLIP_RIGHT;
+        if (v.y > v.w) code |= CLIP_TOP;
+        if (v.y < -v.w) code |= CLIP_BOTTOM;
+        if (v.z < -v.w) code |= CLIP_NEAR;
+        if (v.z > v.w) code |= CLIP_FAR;
+        if (v.x < -gx * v.w) code |= GUARD_LEFT;
+        if (v.x > gx * v.w) code |= GUARD_RIGHT;
+        if (v.y > gy * v.w) code |= GUARD_TOP;
+        if (v.y < -gy * v.w) code |= GUARD_BOTTOM;
+        return code;
+    }
+
+    // How far inside one of the clipped planes the vertex is, negative outside
+    float distance(const clip_vertex& v, int plane) const {
+        switch (plane) {
+        case CLIP_NEAR:    return v.z + v.w;
+        case GUARD_LEFT:   return v.x + gx * v.w;
+        case GUARD_RIGHT:  return gx * v.w - v.x;
+        case GUARD_TOP:    return gy * v.w - v.y;
+        default:           return v.y + gy * v.w;
+        }
+    }
+};
+
+// The point at t along the way from a to b
+inline clip_vertex lerp_vertex(const clip_vertex& a, const clip_vertex& b, float t) {
+    vector3f from = a.color, to = b.color;
+    return clip_vertex(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t,
+                       from + (to - from) * t);
+}
+
+/**
+ * One step of Sutherland-Hodgman: clips the convex polygon in against a plane into out, which needs
+ * room for count + 1 vertices, and returns the new count. New vertices are always interpolated
+ * from the inside end of an edge, so two triangles sharing the edge get exactly the same point.
+ */
+inline int clip_polygon(const clip_vertex* in, int count, clip_vertex* out, const guard_band& band, int plane) {
+    int n = 0;
+    float dPrevious = band.distance(in[count - 1], plane);
+    for (int i = 0; i < count; i++) {
+        const clip_vertex& a = in[(i + count - 1) % count];
+        const clip_vertex& b = in[i];
+        float dA = dPrevious, dB = band.distance(b, plane);
+        if ((dA >= 0) != (dB >= 0)) {
+            out[n++] = dA >= 0 ? lerp_vertex(a, b, dA / (dA - dB)) : lerp_vertex(b, a, dB / (dB - dA));
+        }
+        if (dB >= 0) out[n++] = b;
+        dPrevious = dB;
+    }
+    return n;
+}
+
+// Projects a triangle inside the guard band and in front of the near plane, depth from 0 at the near plane to 1 at the far one
+template <class Sink>
+void draw_projected(Sink& sink, depth_buffer& depth, const clip_vertex& v1, const clip_vertex& v2, const clip_vertex& v3,
+                    const clip_rect& clip) {
+    const clip_vertex* v[3] = {&v1, &v2, &v3};
+    float p[3][3];
+    for (int i = 0; i < 3; i++) {
+        // Only a degenerate projection leaves w at zero here
+        if (v[i]->w <= 0) return;
+        float q = 1 / v[i]->w;
+        p[i][0] = (v[i]->x * q + 1) * 0.5f * sink.width;
+        p[i][1] = (1 - v[i]->y * q) * 0.5f * sink.height;
+        p[i][2] = (v[i]->z * q + 1) * 0.5f;
+    }
+    color_triangle_depth(sink, depth, vector3f(p[0][0], p[0][1], p[0][2]), vector3f(p[1][0], p[1][1], p[1][2]),
+                         vector3f(p[2][0], p[2][1], p[2][2]), v1.w, v2.w, v3.w, v1.color, v2.color, v3.color, clip);
+}
+
+/**
+ * Draws a triangle given in clip space into a memory sink the size of the depth buffer.
+ * Triangles entirely outside one plane of the view volume are dropped, those inside the guard
+ * band are drawn as they are, and only the rest are clipped against the near plane and the
+ * guard band and drawn as a fan. Pixels beyond the far plane fail the depth test of a cleared buffer.
+ */
+template <class Sink>
+void project_triangle(Sink& sink, depth_buffer& depth, const clip_vertex& v1, const clip_vertex& v2, const clip_vertex& v3,
+                      const clip_rect& clip) {
+    guard_band band(sink.width, sink.height);
+    int o1 = band.outcode(v1), o2 = band.outcode(v2), o3 = band.outcode(v3);
+    if (o1 & o2 & o3) {
+        STAT_CULLED();
+        return;
+    }
+    int planes = (o1 | o2 | o3) & CLIPPED_PLANES;
+    if (!planes) {
+        draw_projected(sink, depth, v1, v2, v3, clip);
+        return;
+    }
+
+    // Each plane adds at most one vertex to the triangle
+    clip_vertex polygon[2][8];
+    polygon[0][0] = v1;
+    polygon[0][1] = v2;
+    polygon[0][2] = v3;
+    int count = 3, current = 0;
+    for (int plane = CLIP_NEAR; plane <= GUARD_BOTTOM; plane <<= 1) {
+        if (!(planes & plane)) continue;
+        count = clip_polygon(polygon[current], count, polygon[1 - current], band, plane);
+        current = 1 - current;
+        if (count < 3) {
+            STAT_CULLED();
+            return;
+        }
+    }
+    for (int i = 1; i + 1 < count; i++) {
+        draw_projected(sink, depth, polygon[current][0], polygon[current][i], polygon[current][i + 1], clip);
+    }
+}
+
+void project_triangle(depth_buffer& depth, const clip_vertex& v1, const clip_vertex& v2, const clip_vertex& v3) {
+    locked_bitmap_sink sink;
+    if (!sink.lock()) {
+        // Into a copy when the target is already locked
+        copied_target_sink target;
+        project_triangle(target, depth, v1, v2, v3);
+        target.store();
+        return;
+    }
+    project_triangle(sink, depth, v1, v2, v3);
+    sink.unlock();
+}
+
+// ----------------------- Tiled multithreaded rendering ------------------------ //
+// Triangles are binned into 64x64 screen tiles and a pool of worker threads rasterizes whole tiles.
+// Every tile belongs to exactly one worker at a time, so the shared framebuffer needs no locks,
+// and the triangles of a tile are drawn in the order they were added, so the result is the same
+// as drawing them one after another on a single thread.
+
+const int TILE_SIZE = 64;
+
+/**
+ * A fixed set of threads that run the same task over a range of indices.
+ * The calling thread works along, so a pool of one thread runs everything in place.
+ */
+class worker_pool {
+public:
+    worker_pool(int threads = 0) {
+        if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+        for (int i = 1; i < threads; i++) workers.push_back(thread(&worker_pool::work, this));
+    }
+    ~worker_pool() {
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    /**
+     * Calls task(i) for every i in [0, count) on all threads and returns when all are done.
+     */
+    void run(int count, const function<void(int)>& task) {
+        {
+            lock_guard<mutex> lock(m);
+            current = &task;
+            total = count;
+            next = 0;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain();
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this] { return busy == 0; });
+    }
+
+private:
+    vector<thread> workers;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int)>* current = NULL;
+    int total = 0;
+    atomic<int> next{0};
+    int busy = 0;
+    int generation = 0;
+    bool quit = false;
+
+    void drain() {
+        for (int i = next++; i < total; i = next++) (*current)(i);
+    }
+    void work() {
+        int seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            drain();
+            lock_guard<mutex> lock(m);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+};
+
+struct triangle_command {
+    int x1, y1, x2, y2, x3, y3;
+    vector3f c1, c2, c3;
+};
+
+/**
+ * Collects the triangles of a frame into tile bins and renders them on a worker pool.
+ */
+struct tile_renderer {
+    framebuffer_sink& fb;
+    int tilesX, tilesY;
+    vector<triangle_command> triangles;
+    vector<vector<int> > bins;  // Indices of the triangles touching each tile, in the order they were added
+
+    tile_renderer(framebuffer_sink& fb): fb(fb) {
+        tilesX = (fb.width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (fb.height + TILE_SIZE - 1) / TILE_SIZE;
+        bins.resize(tilesX * tilesY);
+    }
+
+    clip_rect tile_rect(int tile) const {
+        clip_rect r;
+        r.x0 = (tile % tilesX) * TILE_SIZE;
+        r.y0 = (tile / tilesX) * TILE_SIZE;
+        r.x1 = min(r.x0 + TILE_SIZE, fb.width) - 1;
+        r.y1 = min(r.y0 + TILE_SIZE, fb.height) - 1;
+        return r;
+    }
+
+    // Adds the triangle to the bins of all tiles its bounding box overlaps
+    void add_triangle(int x1, int y1, int x2, int y2, int x3, int y3, vector3f c1, vector3f c2, vector3f c3) {
+        triangle_command t = {x1, y1, x2, y2, x3, y3, c1, c2, c3};
+        int index = triangles.size();
+        triangles.push_back(t);
+
+        int minX = max(0, min(x1, min(x2, x3))), maxX = min(fb.width - 1, max(x1, max(x2, x3)));
+        int minY = max(0, min(y1, min(y2, y3))), maxY = min(fb.height - 1, max(y1, max(y2, y3)));
+        if (minX > maxX || minY > maxY) return;
+        for (int ty = minY / TILE_SIZE; ty <= maxY / TILE_SIZE; ty++) {
+            for (int tx = minX / TILE_SIZE; tx <= maxX / TILE_SIZE; tx++) {
+                bins[ty * tilesX + tx].push_back(index);
+            }
+        }
+    }
+
+    /**
+     * Draws all tiles in parallel, then forgets the triangles for the next frame.
+     */
+    void render(worker_pool& pool) {
+        pool.run(bins.size(), [this](int tile) {
+            clip_rect r = tile_rect(tile);
+            const vector<int>& bin = bins[tile];
+            for (size_t i = 0; i < bin.size(); i++) {
+                const triangle_command& t = triangles[bin[i]];
+                color_triangle_fixed(fb, t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, t.c1, t.c2, t.c3, r);
+            }
+        });
+        triangles.clear();
+        for (size_t i = 0; i < bins.size(); i++) bins[i].clear();
+    }
+};
+
+// ----------------------- Utility functions ------------------------ //
+
+/**
+ * Given three triangle vertices sorts them vertically.
+ * Also sorts attribute vectors attached to the vertices.
+ */
+void sort_triangle_with_attributes(int& x1, int& y1, int& x2, int& y2, int& x3, int& y3, vector3f& c1, vector3f& c2, vector3f& c3) {
+    if (y2 > y3) {
+        swap(x2, x3); swap(y2, y3); swap(c2, c3);
+    }
+    if (y1 > y2) {
+        swap(x1, x2); swap(y1, y2); swap(c1, c2);
+    }
+    if (y2 > y3) {
+        swap(x2, x3); swap(y2, y3); swap(c2, c3);
+    }
+    if (y1 == y2 && x1 > x2) {
+        swap(x1, x2); swap(y1, y2); swap(c1, c2);
+    }
+}
+
+// ----------------------- Benchmark ------------------------ //
+// Run as "triangles --bench [options]" to check and time the rasterizers headless against a memory framebuffer:
+//   --reps N          timed repetitions per case (default 30)
+//   --warmup N        untimed repetitions before that (default 3)
+// The checks draw a scene along two paths that must give the same pixels and report the pixels that
+// differ. The exit code is 1 if any check failed.
+
+const int BENCH_WIDTH = 900;
+const int BENCH_HEIGHT = 300;
+
+/**
+ * Small deterministic generator, so that every build benchmarks exactly the same triangles.
+ */
+struct bench_random {
+    uint32_t state;
+    bench_random(uint32_t seed): state(seed) {};
+    int next(int n) {
+        state = state * 1664525u + 1013904223u;
+        return (int)((state >> 8) % (uint32_t)n);
+    }
+    float unit() {
+        return next(256) / 255.0f;
+    }
+};
+
+/**
+ * Gradient triangles with a corner anywhere on the framebuffer and up to size pixels across.
+ */
+vector<triangle_command> random_triangles(int count, int size, uint32_t seed) {
+    bench_random rnd(seed);
+    vector<triangle_command> triangles;
+    for (int i = 0; i < count; i++) {
+        int x = rnd.next(BENCH_WIDTH), y = rnd.next(BENCH_HEIGHT);
+        triangle_command t = {x, y, x + rnd.next(2 * size + 1) - size, y + rnd.next(2 * size + 1) - size,
+                              x + rnd.next(2 * size + 1) - size, y + rnd.next(2 * size + 1) - size,
+                              vector3f(rnd.unit(), rnd.unit(), rnd.unit()), vector3f(rnd.unit(), rnd.unit(), rnd.unit()),
+                              vector3f(rnd.unit(), rnd.unit(), rnd.unit())};
+        triangles.push_back(t);
+    }
+    return triangles;
+}
+
+/**
+ * A grid mesh over the framebuffer with jittered vertices, two clockwise triangles per cell.
+ */
+struct bench_mesh {
+    vector<vector3f> vertices, colors;
+    vector<int> indices;
+
+    bench_mesh(int columns, int rows, uint32_t seed) {
+        bench_random rnd(seed);
+        for (int j = 0; j <= rows; j++) {
+            for (int i = 0; i <= columns; i++) {
+                // Moved by less than half a cell, so that the triangles keep their winding
+                float x = (i + (rnd.next(9) - 4) / 10.0f) * BENCH_WIDTH / columns;
+                float y = (j + (rnd.next(9) - 4) / 10.0f) * BENCH_HEIGHT / rows;
+                vertices.push_back(vector3f(x, y, 0));
+                colors.push_back(vector3f(rnd.unit(), rnd.unit(), rnd.unit()));
+            }
+        }
+        for (int j = 0; j < rows; j++) {
+            for (int i = 0; i < columns; i++) {
+                int a = j * (columns + 1) + i, b = a + 1, c = a + columns + 1, d = c + 1;
+                int cell[6] = {a, b, c, b, d, c};
+                indices.insert(indices.end(), cell, cell + 6);
+            }
+        }
+    }
+    int count() const {
+        return indices.size() / 3;
+    }
+};
+
+struct bench_case {
+    const char* name;
+    function<void(framebuffer_sink&)> draw;
+};
+
+// Median nanoseconds of one run, each on a white framebuffer
+double time_case(const bench_case& c, vector<uint32_t>& pixels, int warmup, int reps) {
+    framebuffer_sink fb(&pixels[0], BENCH_WIDTH, BENCH_HEIGHT);
+    vector<double> samples;
+    for (int r = 0; r < warmup + reps; r++) {
+        fill(pixels.begin(), pixels.end(), 0xFFFFFFFF);
+        auto start = chrono::steady_clock::now();
+        c.draw(fb);
+        auto end = chrono::steady_clock::now();
+        if (r >= warmup) samples.push_back(chrono::duration<double, nano>(end - start).count());
+    }
+    sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Prints the result of a check, which passes if no pixel differs
+bool report_check(const char* actual, const char* expected, int differ) {
+    printf("%-4s %s against %s: %d pixel(s) differ\n", differ ? "FAIL" : "ok", actual, expected, differ);
+    return differ == 0;
+}
+
+/**
+ * Draws both cases on a white framebuffer and prints how many pixels differ. Returns true if none do.
+ */
+bool check_same(const bench_case& expected, const bench_case& actual) {
+    vector<uint32_t> a(BENCH_WIDTH * BENCH_HEIGHT, 0xFFFFFFFF), b(BENCH_WIDTH * BENCH_HEIGHT, 0xFFFFFFFF);
+    framebuffer_sink fa(&a[0], BENCH_WIDTH, BENCH_HEIGHT), fb(&b[0], BENCH_WIDTH, BENCH_HEIGHT);
+    expected.draw(fa);
+    actual.draw(fb);
+    int differ = 0;
+    for (size_t i = 0; i < a.size(); i++) differ += a[i] != b[i];
+    return report_check(actual.name, expected.name, differ);
+}
+
+/**
+ * Draws overlapping triangles of one color each at random depths with color_triangle_depth and
+ * compares every pixel with the nearest triangle covering it, found by testing all of them. Pixels
+ * where two triangles lie within 1/1000 of each other are left out, as rounding of the planes decides there.
+ */
+bool check_depth(int count, uint32_t seed) {
+    bench_random rnd(seed);
+    vector<uint32_t> pixels(BENCH_WIDTH * BENCH_HEIGHT, 0xFFFFFFFF), expected(pixels);
+    vector<double> nearest(pixels.size(), 1), second(pixels.size(), 1);
+    framebuffer_sink fb(&pixels[0], BENCH_WIDTH, BENCH_HEIGHT);
+    depth_buffer depth(BENCH_WIDTH, BENCH_HEIGHT);
+    for (int t = 0; t < count; t++) {
+        int x[3], y[3];
+        float z[3], w[3];
+        for (int k = 0; k < 3; k++) {
+            x[k] = rnd.next(BENCH_WIDTH + 200) - 100;
+            y[k] = rnd.next(BENCH_HEIGHT + 200) - 100;
+            z[k] = 0.05f + rnd.next(900) / 1000.0f;
+            w[k] = 1 + rnd.next(300) / 100.0f;
+        }
+        // A color of its own, drawn exactly whatever the perspective division gives
+        vector3f c((t & 15) * 16 / 255.0f, ((t >> 4) & 15) * 16 / 255.0f, ((t >> 8) & 15) * 16 / 255.0f);
+        color_triangle_depth(fb, depth, vector3f(x[0], y[0], z[0]), vector3f(x[1], y[1], z[1]), vector3f(x[2], y[2], z[2]),
+                             w[0], w[1], w[2], c, c, c);
+
+        int area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+        if (area == 0) continue;
+        if (area < 0) {
+            swap(x[1], x[2]); swap(y[1], y[2]); swap(z[1], z[2]);
+            area = -area;
+        }
+        edge_function edges[3] = {edge_function(x[1], y[1], x[2], y[2]), edge_function(x[2], y[2], x[0], y[0]),
+                                  edge_function(x[0], y[0], x[1], y[1])};
+        for (int py = 0; py < BENCH_HEIGHT; py++) {
+            for (int px = 0; px < BENCH_WIDTH; px++) {
+                int32_t e0 = edges[0].at(px, py), e1 = edges[1].at(px, py), e2 = edges[2].at(px, py);
+                if (e0 < 0 || e1 < 0 || e2 < 0) continue;
+                double d = ((double)e0 * z[0] + (double)e1 * z[1] + (double)e2 * z[2]) / area;
+                int i = py * BENCH_WIDTH + px;
+                if (d < nearest[i]) {
+                    second[i] = nearest[i];
+                    nearest[i] = d;
+                    expected[i] = pack_color(c);
+                } else {
+                    second[i] = min(second[i], d);
+                }
+            }
+        }
+    }
+    int differ = 0;
+    for (size_t i = 0; i < pixels.size(); i++) differ += pixels[i] != expected[i] && second[i] - nearest[i] > 1e-3;
+    return report_check("depth", "nearest triangle", differ);
+}
+
+/**
+ * A ground plane below the camera, from behind it to far past the far plane and far out to the
+ * sides, as a grid of triangles in clip space. Most of them get clipped.
+ */
+vector<clip_vertex> ground_plane(int cells) {
+    const float f = 1, aspect = (float)BENCH_WIDTH / BENCH_HEIGHT, zNear = 0.1f, zFar = 100;
+    vector<clip_vertex> corners;
+    for (int j = 0; j <= cells; j++) {
+        for (int i = 0; i <= cells; i++) {
+            float x = -1000 + 2000.0f * i / cells, y = -1, z = 10 - 1010.0f * j / cells;
+            corners.push_back(clip_vertex(x * f / aspect, y * f, z * (zFar + zNear) / (zNear - zFar) + 2 * zFar * zNear / (zNear - zFar), -z,
+                                          vector3f(0, 0, 0)));
+        }
+    }
+    vector<clip_vertex> triangles;
+    for (int j = 0; j < cells; j++) {
+        for (int i = 0; i < cells; i++) {
+            int a = j * (cells + 1) + i, b = a + 1, c = a + cells + 1, d = c + 1;
+            int cell[6] = {a, b, c, b, d, c};
+            for (int k = 0; k < 6; k++) triangles.push_back(corners[cell[k]]);
+        }
+    }
+    return triangles;
+}
+
+/**
+ * Draws the ground plane one triangle at a time and counts how often each pixel was drawn. Every
+ * pixel well below the horizon must be drawn once, none above it, and none twice.
+ */
+bool check_ground_plane() {
+    vector<clip_vertex> plane = ground_plane(8);
+    vector<uint32_t> pixels(BENCH_WIDTH * BENCH_HEIGHT);
+    vector<int> drawn(pixels.size());
+    framebuffer_sink fb(&pixels[0], BENCH_WIDTH, BENCH_HEIGHT);
+    depth_buffer depth(BENCH_WIDTH, BENCH_HEIGHT);
+    for (size_t t = 0; t < plane.size(); t += 3) {
+        fill(pixels.begin(), pixels.end(), 0xFFFFFFFF);
+        depth.clear();
+        project_triangle(fb, depth, plane[t], plane[t + 1], plane[t + 2]);
+        for (size_t i = 0; i < pixels.size(); i++) drawn[i] += pixels[i] != 0xFFFFFFFF;
+    }
+    // The horizon is the middle row, and the far plane ends the plane a few rows below it
+    int differ = 0;
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        for (int x = 0; x < BENCH_WIDTH; x++) {
+            int n = drawn[y * BENCH_WIDTH + x];
+            if (n > 1 || (y < BENCH_HEIGHT / 2 && n != 0) || (y >= BENCH_HEIGHT / 2 + 10 && n != 1)) differ++;
+        }
+    }
+    return report_check("ground plane", "one triangle per pixel below the horizon", differ);
+}
+
+int run_benchmark(int argc, char** argv) {
+    int reps = 30, warmup = 3;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--reps" && hasValue) reps = max(1, atoi(argv[++i]));
+        else if (arg == "--warmup" && hasValue) warmup = max(0, atoi(argv[++i]));
+        else if (arg != "--bench") cerr << "Ignoring unknown option " << arg << endl;
+    }
+
+    worker_pool pool;
+    // Large triangles, so that most spans are cut at the edges of the tiles
+    vector<triangle_command> gradients = random_triangles(2000, 200, 1);
+
+    bench_case fixed = {"fixed", [&](framebuffer_sink& fb) {
+        for (size_t i = 0; i < gradients.size(); i++) {
+            const triangle_command& t = gradients[i];
+            color_triangle_fixed(fb, t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, t.c1, t.c2, t.c3);
+        }
+    }};
+    bench_case tiled = {"tiled", [&](framebuffer_sink& fb) {
+        tile_renderer tiles(fb);
+        for (size_t i = 0; i < gradients.size(); i++) {
+            const triangle_command& t = gradients[i];
+            tiles.add_triangle(t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, t.c1, t.c2, t.c3);
+        }
+        tiles.render(pool);
+    }};
+
+    // 52200 triangles of a few pixels each, where the setup per triangle counts
+    bench_mesh mesh(180, 145, 2);
+    bench_case meshTriangles = {"mesh per triangle", [&](framebuffer_sink& fb) {
+        for (int t = 0; t < mesh.count(); t++) {
+            const vector3f* v[3];
+            const vector3f* c[3];
+            for (int k = 0; k < 3; k++) {
+                v[k] = &mesh.vertices[mesh.indices[3 * t + k]];
+                c[k] = &mesh.colors[mesh.indices[3 * t + k]];
+            }
+            color_triangle_fixed(fb, v[0]->x, v[0]->y, v[1]->x, v[1]->y, v[2]->x, v[2]->y, *c[0], *c[1], *c[2]);
+        }
+    }};
+    bench_case meshIndexed = {"mesh indexed", [&](framebuffer_sink& fb) {
+        color_triangles(fb, &mesh.vertices[0], &mesh.colors[0], &mesh.indices[0], mesh.count());
+    }};
+
+    // Small triangles behind a full-screen quad, drawn after it and before it
+    depth_buffer depth(BENCH_WIDTH, BENCH_HEIGHT);
+    bench_random rnd(3);
+    vector<vector3f> hidden;
+    for (int i = 0; i < 20000; i++) {
+        int x = rnd.next(BENCH_WIDTH), y = rnd.next(BENCH_HEIGHT);
+        float z = 0.5f + rnd.next(400) / 1000.0f;
+        hidden.push_back(vector3f(x, y, z));
+        hidden.push_back(vector3f(x + 1 + rnd.next(8), y + rnd.next(9) - 4, z));
+        hidden.push_back(vector3f(x + rnd.next(9) - 4, y + 1 + rnd.next(8), z));
+    }
+    auto drawFront = [&](framebuffer_sink& fb) {
+        vector3f a(0, 0, 0.1f), b(BENCH_WIDTH, 0, 0.1f), c(BENCH_WIDTH, BENCH_HEIGHT, 0.1f), d(0, BENCH_HEIGHT, 0.1f);
+        vector3f gray(0.5f, 0.5f, 0.5f);
+        color_triangle_depth(fb, depth, a, b, c, 1, 1, 1, gray, gray, gray);
+        color_triangle_depth(fb, depth, a, c, d, 1, 1, 1, gray, gray, gray);
+    };
+    auto drawHidden = [&](framebuffer_sink& fb) {
+        vector3f red(1, 0, 0), green(0, 1, 0), blue(0, 0, 1);
+        for (size_t i = 0; i < hidden.size(); i += 3) {
+            color_triangle_depth(fb, depth, hidden[i], hidden[i + 1], hidden[i + 2], 1, 1, 1, red, green, blue);
+        }
+    };
+    bench_case occluded = {"depth front to back", [&](framebuffer_sink& fb) {
+        depth.clear();
+        drawFront(fb);
+        drawHidden(fb);
+    }};
+    bench_case overdrawn = {"depth back to front", [&](framebuffer_sink& fb) {
+        depth.clear();
+        drawHidden(fb);
+        drawFront(fb);
+    }};
+
+    // Quads turned every way over a large checkered texture, with perspective
+    vector<uint32_t> checker(2048 * 2048);
+    for (int y = 0; y < 2048; y++) {
+        for (int x = 0; x < 2048; x++) checker[y * 2048 + x] = ((x ^ y) & 32 ? 0xFF000000 | (x / 8) | (y / 8) << 8 : 0xFFFFFFFF);
+    }
+    texture checkered(&checker[0], 2048, 2048);
+    vector<triangle_command> quads = random_triangles(200, 60, 5);
+    auto drawQuads = [&](framebuffer_sink& fb, texture_filter filter) {
+        for (size_t i = 0; i < quads.size(); i++) {
+            const triangle_command& q = quads[i];
+            // The fourth corner completes a parallelogram
+            int x4 = q.x2 + q.x3 - q.x1, y4 = q.y2 + q.y3 - q.y1;
+            texture_triangle(fb, checkered, q.x1, q.y1, q.x2, q.y2, q.x3, q.y3, 1, 2, 2,
+                             vector3f(0, 0), vector3f(1, 0), vector3f(0, 1), filter);
+            texture_triangle(fb, checkered, q.x2, q.y2, x4, y4, q.x3, q.y3, 2, 3, 2,
+                             vector3f(1, 0), vector3f(1, 1), vector3f(0, 1), filter);
+        }
+    };
+    bench_case bilinear = {"texture bilinear", [&](framebuffer_sink& fb) { drawQuads(fb, TEXTURE_BILINEAR); }};
+    bench_case trilinear = {"texture trilinear", [&](framebuffer_sink& fb) { drawQuads(fb, TEXTURE_TRILINEAR); }};
+
+    // With a texture of one color the textured triangles cover the pixels of color_triangle_halfspace
+    uint32_t red = 0xFF0000FF;
+    texture plain(&red, 1, 1);
+    bench_case halfspaceRed = {"halfspace", [&](framebuffer_sink& fb) {
+        for (size_t i = 0; i < gradients.size(); i++) {
+            const triangle_command& t = gradients[i];
+            color_triangle_halfspace(fb, t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, vector3f(1, 0, 0), vector3f(1, 0, 0), vector3f(1, 0, 0));
+        }
+    }};
+    bench_case textureRed = {"texture", [&](framebuffer_sink& fb) {
+        for (size_t i = 0; i < gradients.size(); i++) {
+            const triangle_command& t = gradients[i];
+            texture_triangle(fb, plain, t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, 1, 1, 1,
+                             vector3f(0, 0), vector3f(1, 0), vector3f(0, 1), TEXTURE_BILINEAR);
+        }
+    }};
+
+    // A 20000 triangle grid with 3 to 24 varyings, of which the shader uses the first three
+    bench_mesh grid(100, 100, 6);
+    const int VARYING_COUNTS = 4;
+    static const char* varyingNames[VARYING_COUNTS] = {"3 varyings", "6 varyings", "12 varyings", "24 varyings"};
+    vector<vertex_streams> streams;
+    for (int n = 0; n < VARYING_COUNTS; n++) {
+        vertex_streams v(grid.vertices.size(), 3 << n);
+        for (size_t i = 0; i < grid.vertices.size(); i++) {
+            v.x()[i] = grid.vertices[i].x;
+            v.y()[i] = grid.vertices[i].y;
+            v.varying(0)[i] = grid.colors[i].x;
+            v.varying(1)[i] = grid.colors[i].y;
+            v.varying(2)[i] = grid.colors[i].z;
+            for (int k = 3; k < v.varyingCount; k++) v.varying(k)[i] = rnd.unit();
+        }
+        streams.push_back(v);
+    }
+    vector<bench_case> shaded;
+    for (int n = 0; n < VARYING_COUNTS; n++) {
+        bench_case c = {varyingNames[n], [&, n](framebuffer_sink& fb) {
+            shade_triangles(fb, streams[n], &grid.indices[0], grid.count(), color_shader());
+        }};
+        shaded.push_back(c);
+    }
+
+    // 20000 small triangles without antialiasing and with 4 and 8 samples, corners off the pixel grid
+    vector<triangle_command> small = random_triangles(20000, 8, 7);
+    bench_case aliased = {"small halfspace", [&](framebuffer_sink& fb) {
+        for (size_t i = 0; i < small.size(); i++) {
+            const triangle_command& t = small[i];
+            color_triangle_halfspace(fb, t.x1, t.y1, t.x2, t.y2, t.x3, t.y3, t.c1, t.c2, t.c3);
+        }
+    }};
+    auto drawSmallAA = [&](framebuffer_sink& fb, int samples) {
+        for (size_t i = 0; i < small.size(); i++) {
+            const triangle_command& t = small[i];
+            color_triangle_aa(fb, t.x1 + 0.3f, t.y1 + 0.6f, t.x2 + 0.7f, t.y2 + 0.2f, t.x3 + 0.5f, t.y3 + 0.9f,
+                              t.c1, t.c2, t.c3, samples);
+        }
+    };
+    bench_case aa4 = {"small 4x antialiased", [&](framebuffer_sink& fb) { drawSmallAA(fb, 4); }};
+    bench_case aa8 = {"small 8x antialiased", [&](framebuffer_sink& fb) { drawSmallAA(fb, 8); }};
+
+    vector<clip_vertex> ground = ground_plane(8);
+    bench_case projected = {"ground plane projected", [&](framebuffer_sink& fb) {
+        depth.clear();
+        for (size_t i = 0; i < ground.size(); i += 3) project_triangle(fb, depth, ground[i], ground[i + 1], ground[i + 2]);
+    }};
+
+    int failed = 0;
+    failed += !check_same(fixed, tiled);
+    failed += !check_same(meshTriangles, meshIndexed);
+    failed += !check_same(overdrawn, occluded);
+    failed += !check_depth(400, 4);
+    failed += !check_same(halfspaceRed, textureRed);
+    failed += !check_ground_plane();
+
+    vector<bench_case> cases;
+    cases.push_back(fixed);
+    cases.push_back(tiled);
+    cases.push_back(meshTriangles);
+    cases.push_back(meshIndexed);
+    cases.push_back(occluded);
+    cases.push_back(overdrawn);
+    cases.push_back(bilinear);
+    cases.push_back(trilinear);
+    cases.insert(cases.end(), shaded.begin(), shaded.end());
+    cases.push_back(aliased);
+    cases.push_back(aa4);
+    cases.push_back(aa8);
+    cases.push_back(projected);
+    vector<uint32_t> pixels(BENCH_WIDTH * BENCH_HEIGHT);
+    printf("\n%d repetitions after %d warmup runs, %d thread(s) for the tiled renderer\n\n", reps, warmup, pool.size());
+    printf("%-24s %12s\n", "case", "median us");
+    for (size_t i = 0; i < cases.size(); i++) {
+        printf("%-24s %12.1f\n", cases[i].name, time_case(cases[i], pixels, warmup, reps) / 1000);
+    }
+
+    if (failed) printf("\n%d check(s) failed\n", failed);
+    return failed ? 1 : 0;
+}
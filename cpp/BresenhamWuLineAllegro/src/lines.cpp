@@ -13,11 +13,115 @@ using namespace std;
 #include <allegro5/allegro_color.h>
 
 #include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Threads for the tiled renderer
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// SIMD intrinsics for the multi-line rasterizer
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
 
 // ---------------------------- Global variables -------------------------- //
 ALLEGRO_DISPLAY*    display;
 ALLEGRO_EVENT_QUEUE* event_queue;
 ALLEGRO_EVENT       event;
+double              max_fps = 0;    // Redraws per second for animated content, 0 redraws only when needed
+
+// ---------------------------- Rasterizer statistics -------------------------- //
+// Compiled with RASTER_STATS defined, the rasterizers count their work into stats: pixels and
+// spans written, lines that lay entirely outside the target, and how often every pixel was written,
+// which write_overdraw_ppm turns into a heatmap. Without it the STAT_ macros are empty, their
+// arguments are not even evaluated, and none of this is compiled in.
+
+#ifdef RASTER_STATS
+/**
+ * The totals are atomic since the tiled renderer draws on several threads. The per-pixel counts
+ * need not be, every pixel belongs to a single tile.
+ */
+struct raster_stats {
+    atomic<long long> pixels{0}, spans{0}, spanPixels{0}, culled{0};
+    int width = 0, height = 0;
+    vector<uint32_t> writes;    // Per pixel, rows packed one after another
+
+    // Clears the counters and tracks the writes on a width x height target
+    void reset(int w, int h) {
+        pixels = spans = spanPixels = culled = 0;
+        width = w;
+        height = h;
+        writes.assign(w * h, 0);
+    }
+    void pixel(int x, int y) {
+        pixels++;
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) writes[y * width + x]++;
+    }
+    void hspan(int x, int y, int length) {
+        if (length <= 0) return;
+        spans++;
+        spanPixels += length;
+        pixels += length;
+        if ((unsigned)y >= (unsigned)height) return;
+        for (int from = max(x, 0), to = min(x + length, width); from < to; from++) writes[y * width + from]++;
+    }
+    void vspan(int x, int y, int length) {
+        if (length <= 0) return;
+        spans++;
+        spanPixels += length;
+        pixels += length;
+        if ((unsigned)x >= (unsigned)width) return;
+        for (int from = max(y, 0), to = min(y + length, height); from < to; from++) writes[from * width + x]++;
+    }
+
+    void print(FILE* out) const {
+        long long touched = 0;
+        uint32_t most = 0;
+        for (size_t i = 0; i < writes.size(); i++) {
+            if (writes[i]) touched++;
+            most = max(most, writes[i]);
+        }
+        fprintf(out, "%lld pixels written, %lld spans of %.1f pixels on average, %lld lines culled\n",
+                (long long)pixels, (long long)spans, spans ? spanPixels / (double)spans : 0.0, (long long)culled);
+        fprintf(out, "%lld pixels on the target drawn %.2f times on average, at most %u times\n",
+                touched, touched ? (double)pixels / touched : 0.0, most);
+    }
+};
+raster_stats stats;
+
+/**
+ * Writes the per-pixel counts as a binary PPM: black where nothing was drawn, blue, green, yellow
+ * and red for one to four writes, white for more.
+ */
+bool write_overdraw_ppm(const char* file) {
+    static const unsigned char ramp[6][3] = {{0, 0, 0}, {0, 0, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}, {255, 255, 255}};
+    FILE* f = fopen(file, "wb");
+    if (!f) return false;
+    fprintf(f, "P6\n%d %d\n255\n", stats.width, stats.height);
+    for (size_t i = 0; i < stats.writes.size(); i++) fwrite(ramp[min(stats.writes[i], 5u)], 3, 1, f);
+    fclose(f);
+    return true;
+}
+
+#define STAT_PIXEL(x, y)            stats.pixel(x, y)
+#define STAT_HSPAN(x, y, length)    stats.hspan(x, y, length)
+#define STAT_VSPAN(x, y, length)    stats.vspan(x, y, length)
+#define STAT_CULLED()               stats.culled++
+#else
+#define STAT_PIXEL(x, y)
+#define STAT_HSPAN(x, y, length)
+#define STAT_VSPAN(x, y, length)
+#define STAT_CULLED()
+#endif
 
 // ---------------------------- Forward declarations -------------------------- //
 void init();
@@ -29,12 +133,41 @@ void draw();
 void bresenham_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color);
 void wu_line(int x0, int y0, int x1, int y1, ALLEGRO_COLOR color);
 
-void measurePerformance(void (*lineAlgorithm)(int, int, int, int, ALLEGRO_COLOR), const char* algorithmName);
+// Same pixels as bresenham_line, drawn from both ends at once
+void bresenham_line_symmetric(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color);
+// Same pixels again, written as one span per row or column
+void slice_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color);
+
+// Headless benchmark of the rasterizers, see the Benchmark section at the end
+int run_benchmark(int argc, char** argv);
+
+// Batched versions of the above: the target bitmap is locked once for the whole batch
+struct line_segment {
+    int x1, y1, x2, y2;
+};
+void bresenham_lines(const line_segment* lines, int count, ALLEGRO_COLOR color);
+void wu_lines(const line_segment* lines, int count, ALLEGRO_COLOR color);
+
+// Antialiased lines with subpixel endpoints, drawn with the fixed-point Wu engine
+struct line_segmentf {
+    float x1, y1, x2, y2;
+};
+void wu_lines(const line_segmentf* lines, int count, ALLEGRO_COLOR color);
+
+// Lane-parallel Bresenham for large batches into a memory framebuffer
+struct framebuffer_sink;
+void bresenham_lines_simd(framebuffer_sink& fb, const line_segment* lines, int count, uint32_t color);
 
 // ---------------------------- Main -------------------------- //
 // The overall structure of our program is the familiar GUI event loop:
 
-int main(){
+int main(int argc, char** argv){
+    // "--bench" runs the benchmark instead of opening a window, "--fps N" redraws N times a second
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--bench") return run_benchmark(argc, argv);
+        if (string(argv[i]) == "--fps" && i + 1 < argc) max_fps = atof(argv[++i]);
+    }
+
     init();         // Initialize Allegro.
     event_loop();   // Run the event processing loop until a program is requested to quit
     deinit();       // Deinitialize
@@ -48,6 +181,8 @@ int main(){
 
 void init() {
     al_init();
+    // Expose events tell when the window has to be drawn again, see event_loop
+    al_set_new_display_flags(ALLEGRO_WINDOWED | ALLEGRO_RESIZABLE | ALLEGRO_GENERATE_EXPOSE_EVENTS);
     display = al_create_display(900, 300);
     event_queue = al_create_event_queue();
     al_register_event_source(event_queue, al_get_display_event_source(display));
@@ -67,33 +202,62 @@ void deinit() {
 
 // ---------------------------- Event loop -------------------------- //
 
+// The scene only changes when something happens, so instead of redrawing on a fixed period
+// the loop sleeps in al_wait_for_event and marks the frame dirty when the window was exposed,
+// resized or got input, and with max_fps above 0 on every tick of a timer for animated scenes.
+// A frame is drawn once the queue is empty, so a burst of events costs a single redraw.
+
 void event_loop() {
-    while(1) {
-        // We only need events to close the app when necessary
-        bool have_event = al_wait_for_event_timed(event_queue, &event, 0.05);
-        if (have_event) {
-            if (event.type == ALLEGRO_EVENT_DISPLAY_CLOSE || event.type == ALLEGRO_EVENT_KEY_UP) break;
+    ALLEGRO_TIMER* timer = NULL;
+    if (max_fps > 0) {
+        timer = al_create_timer(1.0 / max_fps);
+        al_register_event_source(event_queue, al_get_timer_event_source(timer));
+        al_start_timer(timer);
+    }
+
+    bool dirty = true;  // The first frame
+    bool quit = false;
+    while (!quit) {
+        if (dirty && al_is_event_queue_empty(event_queue)) {
+            draw();
+            dirty = false;
+        }
+        al_wait_for_event(event_queue, &event);
+        switch (event.type) {
+        case ALLEGRO_EVENT_DISPLAY_CLOSE:
+        case ALLEGRO_EVENT_KEY_UP:
+            quit = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_RESIZE:
+            al_acknowledge_resize(display);
+            dirty = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_EXPOSE:
+        case ALLEGRO_EVENT_DISPLAY_SWITCH_IN:
+        case ALLEGRO_EVENT_KEY_DOWN:        // Input
+        case ALLEGRO_EVENT_TIMER:
+            dirty = true;
+            break;
         }
-        // No animation this time, simply drawing
-        draw();
-   }
+    }
+
+    if (timer) al_destroy_timer(timer);
 }
 
 // ---------------------------- Drawing routines -------------------------- //
 // Where all the drawing is performed.
 
-void al_draw_line_wrapper(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color) {
-    al_draw_line((float)x1, (float)y1, (float)x2, (float)y2, color, 1.0f);
-}
-
 void draw() {
     al_clear_to_color(al_map_rgb(255,255,255));
+#ifdef RASTER_STATS
+    stats.reset(al_get_display_width(display), al_get_display_height(display));
+#endif
 
     // Here we test the implementations of the line algorithms.
     int CX = 150;
     int CY = 150;
     int R = 100;
-    int NUM_LINES = 20;
+    const int NUM_LINES = 20;
     float STEP = 2*3.14/NUM_LINES;
 
     // Reference
@@ -102,69 +266,672 @@ void draw() {
         al_draw_line(CX, CY, CX + (int)(R*cos(STEP*i)), CY + (int)(R*sin(STEP*i)), c, 1);
     }
 
-    // Bresenham
+    // Bresenham, the whole fan drawn as one batch
     c = al_color_name("red");
     CX += 300;
+    line_segment fan[NUM_LINES];
     for (int i = 0; i < NUM_LINES; i++) {
-        bresenham_line(CX, CY, CX + (int)(R*cos(STEP*i)), CY + (int)(R*sin(STEP*i)), c);
+        fan[i] = {CX, CY, CX + (int)(R*cos(STEP*i)), CY + (int)(R*sin(STEP*i))};
     }
+    bresenham_lines(fan, NUM_LINES, c);
 
-
-    // Wu
+    // Wu, also batched
     c = al_color_name("purple");
     CX += 300;
     for (int i = 0; i < NUM_LINES; i++) {
-        wu_line(CX, CY, CX + (int)(R * cos(STEP * i)), CY + (int)(R * sin(STEP * i)), c);
+        fan[i] = {CX, CY, CX + (int)(R * cos(STEP * i)), CY + (int)(R * sin(STEP * i))};
     }
+    wu_lines(fan, NUM_LINES, c);
 
-//    // Measure performance
-//    measurePerformance(bresenham_line, "Bresenham's Algorithm");
-//    measurePerformance(wu_line, "Wu's Algorithm");
-//    measurePerformance(al_draw_line_wrapper, "Canvas Drawing (Reference)");
+#ifdef RASTER_STATS
+    // Every frame draws the same, so the first one is reported
+    static bool reported = false;
+    if (!reported) {
+        stats.print(stdout);
+        write_overdraw_ppm("overdraw.ppm");
+        reported = true;
+    }
+#endif
 
     // We end by flipping the buffer:
     al_flip_display();
 }
 
+// ----------------------- Pixel sinks ------------------------ //
+// The rasterizers below are templates over where their pixels go, so the same code draws to the
+// display, into a locked bitmap or into plain memory without an Allegro display at all.
+// A pixel sink provides:
+//   typedef ... color;                                   - the color type it takes
+//   void put(int x, int y, color c);                     - write an opaque pixel
+//   void blend(int x, int y, color c, float alpha);      - blend the color with given coverage
+//   void blend(int x, int y, const wu_blend_lut& lut, int coverage);
+//                                                        - same with 0..255 coverage and a precomputed color
+//   void hspan(int x, int y, int length, color c);       - write the opaque pixels x .. x + length - 1 of row y
+//   void vspan(int x, int y, int length, color c);       - same down column x
+//   clip_rect bounds();                                  - the pixels it can write, lines are clipped to it
+// All are defined in the class body, so every instantiation gets its write path inlined.
+
+/**
+ * Rectangle of pixels, both corners inclusive.
+ */
+struct clip_rect {
+    int x0, y0, x1, y1;
+};
+
+// Memory sinks use packed 0xAABBGGRR pixels, i.e. ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE
+uint32_t pack_color(ALLEGRO_COLOR color) {
+    unsigned char r, g, b, a;
+    al_unmap_rgba(color, &r, &g, &b, &a);
+    return r | (g << 8) | (b << 16) | ((uint32_t)a << 24);
+}
+
+/**
+ * Same result as drawing the color scaled by alpha with Allegro's default premultiplied
+ * blender: every channel becomes src * alpha + dst * (1 - alpha).
+ */
+inline uint32_t blend_packed(uint32_t dst, uint32_t color, float alpha) {
+    uint32_t a = (uint32_t)(alpha * 255 + 0.5f);
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t s = (color >> shift) & 0xFF;
+        uint32_t d = (dst >> shift) & 0xFF;
+        result |= ((s * a + d * (255 - a) + 127) / 255) << shift;
+    }
+    return result;
+}
+
+/**
+ * Blend table of one line color for the fixed-point Wu engine. Entry a holds the color
+ * premultiplied by a / 255 with alpha a, i.e. the source term of the blend for coverage a,
+ * so no color has to be unmapped or scaled per pixel.
+ */
+struct wu_blend_lut {
+    uint32_t premultiplied[256];
+
+    wu_blend_lut(uint32_t color) {
+        for (uint32_t a = 0; a < 256; a++) {
+            uint32_t entry = a << 24;
+            for (int shift = 0; shift < 24; shift += 8) {
+                // Rounded down, so that adding the destination term can never overflow a channel
+                entry |= (((color >> shift) & 0xFF) * a / 255) << shift;
+            }
+            premultiplied[a] = entry;
+        }
+    }
+
+    // dst * (1 - a) + premultiplied[a], two channels at a time
+    uint32_t blend(uint32_t dst, int coverage) const {
+        uint32_t inv = 255 - coverage;
+        uint32_t rb = (dst & 0x00FF00FF) * inv + 0x00800080;
+        rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+        uint32_t ga = ((dst >> 8) & 0x00FF00FF) * inv + 0x00800080;
+        ga = (ga + ((ga >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+        return premultiplied[coverage] + (rb | ga);
+    }
+};
+
+/**
+ * Draws through Allegro one pixel at a time, like the original exercise code.
+ * Lines are clipped to the clipping rectangle of the target, see al_set_clipping_rectangle.
+ */
+struct allegro_sink {
+    typedef ALLEGRO_COLOR color;
+
+    void put(int x, int y, ALLEGRO_COLOR c) {
+        al_draw_pixel(x, y, c);
+    }
+    void blend(int x, int y, ALLEGRO_COLOR c, float alpha) {
+        float r, g, b;
+        al_unmap_rgb_f(c, &r, &g, &b); // Unmap the color to retrieve its components.
+
+        // Create a new color based on the original color and brightness
+        al_draw_pixel(x, y, al_map_rgba_f(r * alpha, g * alpha, b * alpha, alpha));
+    }
+    void blend(int x, int y, const wu_blend_lut& lut, int coverage) {
+        uint32_t c = lut.premultiplied[coverage];
+        al_draw_pixel(x, y, al_map_rgba(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF, c >> 24));
+    }
+    // A filled rectangle covers exactly the pixels whose centers lie inside it
+    void hspan(int x, int y, int length, ALLEGRO_COLOR c) {
+        al_draw_filled_rectangle(x, y, x + length, y + 1, c);
+    }
+    void vspan(int x, int y, int length, ALLEGRO_COLOR c) {
+        al_draw_filled_rectangle(x, y, x + 1, y + length, c);
+    }
+    clip_rect bounds() {
+        int x, y, w, h;
+        al_get_clipping_rectangle(&x, &y, &w, &h);
+        clip_rect r = {x, y, x + w - 1, y + h - 1};
+        return r;
+    }
+};
+
+/**
+ * A plain RGBA framebuffer in memory, one uint32_t per pixel, rows packed one after another.
+ * Pixels outside of it are dropped, as al_draw_pixel would.
+ */
+struct framebuffer_sink {
+    typedef uint32_t color;
+    uint32_t* pixels;
+    int width, height;
+
+    framebuffer_sink(uint32_t* pixels, int width, int height): pixels(pixels), width(width), height(height) {};
+
+    void put(int x, int y, uint32_t c) {
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) pixels[y * width + x] = c;
+    }
+    void blend(int x, int y, uint32_t c, float alpha) {
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) {
+            uint32_t& p = pixels[y * width + x];
+            p = blend_packed(p, c, alpha);
+        }
+    }
+    void blend(int x, int y, const wu_blend_lut& lut, int coverage) {
+        if ((unsigned)x < (unsigned)width && (unsigned)y < (unsigned)height) {
+            uint32_t& p = pixels[y * width + x];
+            p = lut.blend(p, coverage);
+        }
+    }
+    void hspan(int x, int y, int length, uint32_t c) {
+        if ((unsigned)y >= (unsigned)height) return;
+        int from = max(x, 0), to = min(x + length, width);
+        if (from < to) fill_n(pixels + y * width + from, to - from, c);
+    }
+    void vspan(int x, int y, int length, uint32_t c) {
+        if ((unsigned)x >= (unsigned)width) return;
+        int from = max(y, 0), to = min(y + length, height);
+        for (uint32_t* p = pixels + from * width + x; from < to; from++, p += width) *p = c;
+    }
+    clip_rect bounds() {
+        clip_rect r = {0, 0, width - 1, height - 1};
+        return r;
+    }
+};
+
+/**
+ * Writes into the locked region of an Allegro bitmap.
+ * lock() locks only the part of the target bitmap covered by the given lines and inside its
+ * clipping rectangle, so the same pixels are drawn as through Allegro.
+ */
+struct locked_bitmap_sink {
+    typedef uint32_t color;
+    ALLEGRO_BITMAP* bitmap;
+    unsigned char* data;
+    int pitch;          // Bytes between rows, may be negative
+    int x0, y0;         // Top left corner of the locked region on the bitmap
+    int width, height;  // Size of the locked region
+
+    /**
+     * Returns false if there is nothing to draw or the bitmap could not be locked.
+     * Works for both integer and float segments.
+     */
+    template <class Segment>
+    bool lock(const Segment* lines, int count) {
+        bitmap = al_get_target_bitmap();
+        int w = al_get_bitmap_width(bitmap);
+        int h = al_get_bitmap_height(bitmap);
+
+        // Bounding box of the batch, one extra pixel around for the antialiased neighbours
+        int minX = w, minY = h, maxX = -1, maxY = -1;
+        for (int i = 0; i < count; i++) {
+            minX = min(minX, (int)floor(min(lines[i].x1, lines[i].x2)) - 1);
+            minY = min(minY, (int)floor(min(lines[i].y1, lines[i].y2)) - 1);
+            maxX = max(maxX, (int)ceil(max(lines[i].x1, lines[i].x2)) + 1);
+            maxY = max(maxY, (int)ceil(max(lines[i].y1, lines[i].y2)) + 1);
+        }
+        int clipX, clipY, clipW, clipH;
+        al_get_clipping_rectangle(&clipX, &clipY, &clipW, &clipH);
+        minX = max(minX, max(clipX, 0));                 minY = max(minY, max(clipY, 0));
+        maxX = min(maxX, min(clipX + clipW, w) - 1);     maxY = min(maxY, min(clipY + clipH, h) - 1);
+        if (minX > maxX || minY > maxY) return false;
+
+        ALLEGRO_LOCKED_REGION* region = al_lock_bitmap_region(bitmap, minX, minY, maxX - minX + 1, maxY - minY + 1,
+                                                              ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_READWRITE);
+        if (region == NULL) return false;
+        data = (unsigned char*)region->data;
+        pitch = region->pitch;
+        x0 = minX;
+        y0 = minY;
+        width = maxX - minX + 1;
+        height = maxY - minY + 1;
+        return true;
+    }
+    void unlock() {
+        al_unlock_bitmap(bitmap);
+    }
+
+    // Returns the address of a pixel in the locked region or NULL if it lies outside
+    uint32_t* address(int x, int y) {
+        x -= x0;
+        y -= y0;
+        if ((unsigned)x >= (unsigned)width || (unsigned)y >= (unsigned)height) return NULL;
+        return (uint32_t*)(data + y * pitch) + x;
+    }
+    void put(int x, int y, uint32_t c) {
+        uint32_t* p = address(x, y);
+        if (p) *p = c;
+    }
+    void blend(int x, int y, uint32_t c, float alpha) {
+        uint32_t* p = address(x, y);
+        if (p) *p = blend_packed(*p, c, alpha);
+    }
+    void blend(int x, int y, const wu_blend_lut& lut, int coverage) {
+        uint32_t* p = address(x, y);
+        if (p) *p = lut.blend(*p, coverage);
+    }
+    void hspan(int x, int y, int length, uint32_t c) {
+        x -= x0;
+        y -= y0;
+        if ((unsigned)y >= (unsigned)height) return;
+        int from = max(x, 0), to = min(x + length, width);
+        if (from < to) fill_n((uint32_t*)(data + y * pitch) + from, to - from, c);
+    }
+    void vspan(int x, int y, int length, uint32_t c) {
+        x -= x0;
+        y -= y0;
+        if ((unsigned)x >= (unsigned)width) return;
+        int from = max(y, 0), to = min(y + length, height);
+        for (unsigned char* row = data + from * pitch; from < to; from++, row += pitch) ((uint32_t*)row)[x] = c;
+    }
+    clip_rect bounds() {
+        clip_rect r = {x0, y0, x0 + width - 1, y0 + height - 1};
+        return r;
+    }
+};
+
+/**
+ * Only counts the pixels, so that pure rasterization cost can be measured.
+ * Lines are clipped to area, by default large enough for any line while the clipping
+ * arithmetic cannot overflow.
+ */
+struct counting_sink {
+    typedef uint32_t color;
+    long long pixels;
+    clip_rect area;
+
+    // The default area still fits the 16.16 coordinates of the fixed point Wu lines
+    counting_sink(): pixels(0) {
+        clip_rect r = {-(1 << 14), -(1 << 14), 1 << 14, 1 << 14};
+        area = r;
+    }
+    counting_sink(const clip_rect& area): pixels(0), area(area) {}
+
+    void put(int, int, uint32_t) {
+        pixels++;
+    }
+    void blend(int, int, uint32_t, float) {
+        pixels++;
+    }
+    void blend(int, int, const wu_blend_lut&, int) {
+        pixels++;
+    }
+    void hspan(int, int, int length, uint32_t) {
+        pixels += length;
+    }
+    void vspan(int, int, int length, uint32_t) {
+        pixels += length;
+    }
+    clip_rect bounds() {
+        return area;
+    }
+};
+
+// ----------------------- Line clipping ------------------------ //
+// Lines far outside the target would otherwise be walked pixel by pixel only for the sink to drop
+// every pixel. The integer rasterizers instead walk only the steps whose pixels are inside:
+// Liang-Barsky on the step index, where each edge of the rectangle narrows the range of steps.
+// Clipping this way keeps the pixels exactly those of the whole line, which cutting the line at new
+// integer endpoints would not. Wu lines are cut as float segments, see clip_segment.
+
+/**
+ * Steps along the major axis of a line, both inclusive. Step k is the pixel k steps from the first endpoint.
+ */
+struct step_range {
+    int first, last;
+};
+
+/**
+ * Bresenham state after k steps: the minor axis has moved floor((2k * minor + major) / (2 * major))
+ * pixels and the error is what the incremental loop would hold then.
+ */
+inline void bresenham_state(int k, int dMajor, int dMinor, int& moved, int& error) {
+    int64_t m = dMajor ? (2 * (int64_t)k * dMinor + dMajor) / (2 * (int64_t)dMajor) : 0;
+    moved = (int)m;
+    error = (int)(2 * (int64_t)k * dMinor - 2 * (int64_t)dMajor * m);
+}
+
+// First step at which the minor axis has moved m pixels, the inverse of bresenham_state
+inline int64_t bresenham_step_of(int64_t m, int dMajor, int dMinor) {
+    if (m <= 0) return 0;
+    if (dMinor == 0) return (int64_t)dMajor + 1;  // Never
+    return ((2 * m - 1) * dMajor + 2 * dMinor - 1) / (2 * dMinor);
+}
+
+/**
+ * Finds the steps of the line whose pixels are inside clip. Returns false if there are none.
+ */
+bool clip_steps(int x1, int y1, int x2, int y2, const clip_rect& clip, step_range& steps) {
+    int dx = abs(x2 - x1), dy = abs(y2 - y1);
+    bool horizontal = dx >= dy;
+    int dMajor = horizontal ? dx : dy, dMinor = horizontal ? dy : dx;
+    steps.first = 0;
+    steps.last = dMajor;
+
+    // Both endpoints inside is by far the most common case
+    if (x1 >= clip.x0 && x1 <= clip.x1 && y1 >= clip.y0 && y1 <= clip.y1 &&
+        x2 >= clip.x0 && x2 <= clip.x1 && y2 >= clip.y0 && y2 <= clip.y1) return true;
+
+    int majorStart = horizontal ? x1 : y1, minorStart = horizontal ? y1 : x1;
+    bool majorUp = horizontal ? x1 < x2 : y1 < y2;
+    bool minorUp = horizontal ? y1 < y2 : x1 < x2;
+    int majorLow = horizontal ? clip.x0 : clip.y0, majorHigh = horizontal ? clip.x1 : clip.y1;
+    int minorLow = horizontal ? clip.y0 : clip.x0, minorHigh = horizontal ? clip.y1 : clip.x1;
+
+    // The major coordinate moves one pixel per step
+    int64_t first = majorUp ? (int64_t)majorLow - majorStart : (int64_t)majorStart - majorHigh;
+    int64_t last = majorUp ? (int64_t)majorHigh - majorStart : (int64_t)majorStart - majorLow;
+
+    // The minor one has to have moved between enter and leave pixels, counted in its direction
+    int64_t enter = minorUp ? (int64_t)minorLow - minorStart : (int64_t)minorStart - minorHigh;
+    int64_t leave = minorUp ? (int64_t)minorHigh - minorStart : (int64_t)minorStart - minorLow;
+    if (leave < 0 || enter > dMinor) return false;
+    first = max(first, bresenham_step_of(enter, dMajor, dMinor));
+    if (leave < dMinor) last = min(last, bresenham_step_of(leave + 1, dMajor, dMinor) - 1);
+
+    first = max(first, (int64_t)0);
+    last = min(last, (int64_t)dMajor);
+    if (first > last) return false;
+    steps.first = (int)first;
+    steps.last = (int)last;
+    return true;
+}
+
+/**
+ * Liang-Barsky clipping of a float segment to clip grown by margin pixels on every side.
+ * Returns false if nothing is left; endpoints inside are kept exactly.
+ * Wu lines are cut with a margin of two pixels, so their dimmed end caps fall outside the target.
+ */
+bool clip_segment(float& x1, float& y1, float& x2, float& y2, const clip_rect& clip, float margin) {
+    float dx = x2 - x1, dy = y2 - y1;
+    float p[4] = {-dx, dx, -dy, dy};
+    float q[4] = {x1 - (clip.x0 - margin), (clip.x1 + margin) - x1, y1 - (clip.y0 - margin), (clip.y1 + margin) - y1};
+    float t0 = 0, t1 = 1;
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) return false;  // Parallel to this edge and outside of it
+        } else {
+            float t = q[i] / p[i];
+            if (p[i] < 0) t0 = max(t0, t);
+            else t1 = min(t1, t);
+        }
+    }
+    if (t0 > t1) return false;
+    float sx = x1, sy = y1;
+    if (t1 < 1) {
+        x2 = sx + t1 * dx;
+        y2 = sy + t1 * dy;
+    }
+    if (t0 > 0) {
+        x1 = sx + t0 * dx;
+        y1 = sy + t0 * dy;
+    }
+    return true;
+}
+
 // ----------------------- Exercises ------------------------ //
 
-void bresenham_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color) {
+/**
+ * Draws the given steps of the line, see clip_steps.
+ */
+template <class Sink>
+void bresenham_steps(Sink& sink, int x1, int y1, int x2, int y2, const step_range& steps, typename Sink::color color) {
     int dx = abs(x2 - x1);
     int dy = abs(y2 - y1);
 
-    int x = x1;
-    int y = y1;
-
     int xStep = (x1 < x2) ? 1 : -1;  // Decide step direction for x
     int yStep = (y1 < y2) ? 1 : -1;  // Decide step direction for y
 
-    float error = 0.0;
+    // The error is kept scaled by 2 * the major delta, so it stays integer:
+    // adding 2 * minor delta per step and stepping the minor axis once it reaches half a pixel.
+    int moved, error;
 
     if(dx >= dy) {  // If line is more horizontal
-        float deltaError = static_cast<float>(dy) / dx;
-
-        for (; x != x2; x += xStep) {
-            al_draw_pixel(x, y, color);
-            error += deltaError;
-            if (error >= 0.5) {
+        bresenham_state(steps.first, dx, dy, moved, error);
+        int x = x1 + steps.first * xStep;
+        int y = y1 + moved * yStep;
+        for (int k = steps.first; k <= steps.last; k++, x += xStep) {
+            sink.put(x, y, color);
+            STAT_PIXEL(x, y);
+            error += 2 * dy;
+            if (error >= dx) {
                 y += yStep;
-                error -= 1.0;
+                error -= 2 * dx;
             }
         }
     } else {  // If line is more vertical
-        float deltaError = static_cast<float>(dx) / dy;
-
-        for (; y != y2; y += yStep) {
-            al_draw_pixel(x, y, color);
-            error += deltaError;
-            if (error >= 0.5) {
+        bresenham_state(steps.first, dy, dx, moved, error);
+        int x = x1 + moved * xStep;
+        int y = y1 + steps.first * yStep;
+        for (int k = steps.first; k <= steps.last; k++, y += yStep) {
+            sink.put(x, y, color);
+            STAT_PIXEL(x, y);
+            error += 2 * dx;
+            if (error >= dy) {
                 x += xStep;
-                error -= 1.0;
+                error -= 2 * dy;
             }
         }
     }
+}
+
+/**
+ * Bresenham restricted to the pixels inside clip, exactly the pixels of the whole line that lie inside.
+ */
+template <class Sink>
+void bresenham_line_clipped(Sink& sink, int x1, int y1, int x2, int y2, typename Sink::color color, const clip_rect& clip) {
+    step_range steps;
+    if (clip_steps(x1, y1, x2, y2, clip, steps)) bresenham_steps(sink, x1, y1, x2, y2, steps, color);
+}
+
+template <class Sink>
+void bresenham_line(Sink& sink, int x1, int y1, int x2, int y2, typename Sink::color color) {
+    step_range steps;
+    if (!clip_steps(x1, y1, x2, y2, sink.bounds(), steps)) {
+        STAT_CULLED();
+        return;
+    }
+    bresenham_steps(sink, x1, y1, x2, y2, steps, color);
+}
+
+void bresenham_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color) {
+    allegro_sink sink;
+    bresenham_line(sink, x1, y1, x2, y2, color);
+}
+
+// put a pixel given by its major and minor axis coordinates
+template <bool Steep, class Sink>
+inline void put_major(Sink& sink, int major, int minor, typename Sink::color color) {
+    if (Steep) sink.put(minor, major, color);
+    else sink.put(major, minor, color);
+    STAT_PIXEL(Steep ? minor : major, Steep ? major : minor);
+}
+
+/**
+ * Walks from both endpoints towards the middle, two steps per end and loop iteration, so a
+ * loop iteration draws four pixels and long lines take a quarter of the iterations.
+ * One look at the error picks which of the four patterns the next two steps follow
+ * (no minor step, a step on the first or the second, or both).
+ *
+ * The pixels are exactly those of bresenham_line. From the start the minor offset after k steps is
+ * floor((2k * minor + major) / (2 * major)), so ties round up; seen from the end, the same pixels
+ * round ties down, which is why the backward walker steps only once its error exceeds the threshold.
+ */
+template <bool Steep, class Sink>
+void bresenham_symmetric_walk(Sink& sink, int a1, int b1, int a2, int b2, const step_range& steps, typename Sink::color color) {
+    int dMajor = abs(a2 - a1), dMinor = abs(b2 - b1);
+    int aStep = (a1 < a2) ? 1 : -1, bStep = (b1 < b2) ? 1 : -1;
+    int one = 2 * dMinor, two = 4 * dMinor, back = 2 * dMajor;
+
+    // The walkers start at the ends of the clipped steps. Seen from the end the error is
+    // the negated forward one, since both measure how far the line is from the same pixel.
+    int moved, error;
+    bresenham_state(steps.first, dMajor, dMinor, moved, error);
+    int fa = a1 + steps.first * aStep, fb = b1 + moved * bStep, fe = error;  // Forward walker, its next pixel and error
+    bresenham_state(steps.last, dMajor, dMinor, moved, error);
+    int ra = a1 + steps.last * aStep, rb = b1 + moved * bStep, re = -error;  // Backward walker
+    int left = steps.last - steps.first;                                     // Steps between the two walkers' next pixels
+
+    for (; left >= 3; left -= 4) {
+        put_major<Steep>(sink, fa, fb, color);
+        put_major<Steep>(sink, ra, rb, color);
+
+        if (fe + two < dMajor) {            // No minor step
+            put_major<Steep>(sink, fa + aStep, fb, color);
+            fe += two;
+        } else if (fe + one < dMajor) {     // Step on the second
+            put_major<Steep>(sink, fa + aStep, fb, color);
+            fb += bStep;
+            fe += two - back;
+        } else if (fe + two - back < dMajor) { // Step on the first
+            fb += bStep;
+            put_major<Steep>(sink, fa + aStep, fb, color);
+            fe += two - back;
+        } else {                            // Both
+            put_major<Steep>(sink, fa + aStep, fb + bStep, color);
+            fb += 2 * bStep;
+            fe += two - 2 * back;
+        }
+        fa += 2 * aStep;
+
+        if (re + two <= dMajor) {
+            put_major<Steep>(sink, ra - aStep, rb, color);
+            re += two;
+        } else if (re + one <= dMajor) {
+            put_major<Steep>(sink, ra - aStep, rb, color);
+            rb -= bStep;
+            re += two - back;
+        } else if (re + two - back <= dMajor) {
+            rb -= bStep;
+            put_major<Steep>(sink, ra - aStep, rb, color);
+            re += two - back;
+        } else {
+            put_major<Steep>(sink, ra - aStep, rb - bStep, color);
+            rb -= 2 * bStep;
+            re += two - 2 * back;
+        }
+        ra -= 2 * aStep;
+    }
+
+    // Up to three pixels left in the middle, finished by the forward walker
+    for (; left >= 0; left--) {
+        put_major<Steep>(sink, fa, fb, color);
+        fe += one;
+        if (fe >= dMajor) {
+            fb += bStep;
+            fe -= back;
+        }
+        fa += aStep;
+    }
+}
+
+template <class Sink>
+void bresenham_line_symmetric(Sink& sink, int x1, int y1, int x2, int y2, typename Sink::color color) {
+    step_range steps;
+    if (!clip_steps(x1, y1, x2, y2, sink.bounds(), steps)) {
+        STAT_CULLED();
+        return;
+    }
+    if (abs(x2 - x1) >= abs(y2 - y1)) bresenham_symmetric_walk<false>(sink, x1, y1, x2, y2, steps, color);
+    else bresenham_symmetric_walk<true>(sink, y1, x1, y2, x2, steps, color);
+}
+
+void bresenham_line_symmetric(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color) {
+    allegro_sink sink;
+    bresenham_line_symmetric(sink, x1, y1, x2, y2, color);
+}
+
+// write a run of pixels along the major axis, starting at the first one in walking direction
+template <bool Steep, class Sink>
+inline void put_run(Sink& sink, int major, int minor, int length, int majorStep, typename Sink::color color) {
+    if (majorStep < 0) major -= length - 1;
+    if (Steep) {
+        sink.vspan(minor, major, length, color);
+        STAT_VSPAN(minor, major, length);
+    } else {
+        sink.hspan(major, minor, length, color);
+        STAT_HSPAN(major, minor, length);
+    }
+}
+
+/**
+ * Run-slice version of Bresenham: instead of deciding pixel by pixel, it computes how many pixels
+ * stay on each row (column, for steep lines) and writes every run as one span.
+ *
+ * With the rounding of bresenham_line the run on minor offset m starts after
+ * ceil((2m - 1) * major / (2 * minor)) steps, so runs are either major / minor pixels
+ * long or one more. The fraction of that division is carried from run to run in integers.
+ * The first and last runs are cut at the ends of the clipped steps.
+ */
+template <bool Steep, class Sink>
+void slice_walk(Sink& sink, int a1, int b1, int a2, int b2, const step_range& steps, typename Sink::color color) {
+    int dMajor = abs(a2 - a1), dMinor = abs(b2 - b1);
+    int aStep = (a1 < a2) ? 1 : -1, bStep = (b1 < b2) ? 1 : -1;
+
+    if (dMinor == 0) {
+        put_run<Steep>(sink, a1 + steps.first * aStep, b1, steps.last - steps.first + 1, aStep, color);
+        return;
+    }
+
+    int divisor = 2 * dMinor;
+    int run = 2 * dMajor / divisor;         // Shorter run length
+    int runRemainder = 2 * dMajor % divisor;
+
+    // The run the first step lies on ends where the next one starts
+    int moved, error;
+    bresenham_state(steps.first, dMajor, dMinor, moved, error);
+    int64_t numerator = (2 * (int64_t)moved + 1) * dMajor;
+    int next = (int)((numerator + divisor - 1) / divisor);
+    int remainder = (int)(next * (int64_t)divisor - numerator); // How far the exact start lies before the rounded one, in 1 / divisor
+
+    int k = steps.first;
+    int b = b1 + moved * bStep;
+    while (true) {
+        int end = min(next - 1, steps.last);
+        put_run<Steep>(sink, a1 + k * aStep, b, end - k + 1, aStep, color);
+        if (end == steps.last) break;
+
+        k = next;
+        b += bStep;
+        int length = run;
+        remainder -= runRemainder;
+        if (remainder < 0) {
+            length++;
+            remainder += divisor;
+        }
+        next += length;
+    }
+}
+
+/**
+ * Draws runs as spans once they are long enough to pay for it; below about three pixels
+ * per run the pixel loop is faster, and draws the same pixels.
+ */
+template <class Sink>
+void slice_line(Sink& sink, int x1, int y1, int x2, int y2, typename Sink::color color) {
+    step_range steps;
+    if (!clip_steps(x1, y1, x2, y2, sink.bounds(), steps)) {
+        STAT_CULLED();
+        return;
+    }
+    int dx = abs(x2 - x1), dy = abs(y2 - y1);
+    if (dx >= 3 * dy) slice_walk<false>(sink, x1, y1, x2, y2, steps, color);
+    else if (dy >= 3 * dx) slice_walk<true>(sink, y1, x1, y2, x2, steps, color);
+    else bresenham_steps(sink, x1, y1, x2, y2, steps, color);
+}
 
-    al_draw_pixel(x2, y2, color);  // Ensure endpoint is plotted
+void slice_line(int x1, int y1, int x2, int y2, ALLEGRO_COLOR color) {
+    allegro_sink sink;
+    slice_line(sink, x1, y1, x2, y2, color);
 }
 
 // get fractional part of a number
@@ -177,18 +944,23 @@ float rfpart(float x) {
     return 1.0 - fpart(x);
 }
 
-// draw a pixel with given alpha
-void plot(int x, int y, float alpha, ALLEGRO_COLOR color) {
-    float r, g, b, a;
-    al_unmap_rgb_f(color, &r, &g, &b); // Unmap the color to retrieve its components.
-
-    // Create a new color based on the original color and brightness
-    ALLEGRO_COLOR blended_color = al_map_rgba_f(r * alpha, g * alpha, b * alpha, alpha);
-    al_draw_pixel(x, y, blended_color);
+// draw a pixel with given alpha, swapping x and y back for steep lines
+template <class Sink>
+inline void plot(Sink& sink, bool steep, int x, int y, float alpha, typename Sink::color color) {
+    if (steep) sink.blend(y, x, color, alpha);
+    else sink.blend(x, y, color, alpha);
+    STAT_PIXEL(steep ? y : x, steep ? x : y);
 }
 
-void wu_line(int x0, int y0, int x1, int y1, ALLEGRO_COLOR color) {
-    bool steep = abs(y1 - y0) > abs(x1 - x0); // If line is more vertical, , swap x and y
+template <class Sink>
+void wu_line(Sink& sink, float x0, float y0, float x1, float y1, typename Sink::color color) {
+    // Cut the line to the sink, leaving the end caps outside
+    if (!clip_segment(x0, y0, x1, y1, sink.bounds(), 2)) {
+        STAT_CULLED();
+        return;
+    }
+
+    bool steep = fabs(y1 - y0) > fabs(x1 - x0); // If line is more vertical, , swap x and y
     if (steep) {
         std::swap(x0, y0);
         std::swap(x1, y1);
@@ -207,14 +979,9 @@ void wu_line(int x0, int y0, int x1, int y1, ALLEGRO_COLOR color) {
     float yend = y0 + gradient * (xend - x0);
     float xgap = rfpart(x0 + 0.5);
     int xpxl1 = xend;
-    int ypxl1 = (int)yend;
-    if (steep) {
-        plot(ypxl1, xpxl1, rfpart(yend) * xgap, color);
-        plot(ypxl1 + 1, xpxl1, fpart(yend) * xgap, color);
-    } else {
-        plot(xpxl1, ypxl1, rfpart(yend) * xgap, color);
-        plot(xpxl1, ypxl1 + 1, fpart(yend) * xgap, color);
-    }
+    int ypxl1 = floor(yend);
+    plot(sink, steep, xpxl1, ypxl1, rfpart(yend) * xgap, color);
+    plot(sink, steep, xpxl1, ypxl1 + 1, fpart(yend) * xgap, color);
     // Iterate y by gradient for next step
     float intery = yend + gradient;
 
@@ -223,45 +990,813 @@ void wu_line(int x0, int y0, int x1, int y1, ALLEGRO_COLOR color) {
     yend = y1 + gradient * (xend - x1);
     xgap = fpart(x1 + 0.5);
     int xpxl2 = xend;
-    int ypxl2 = (int)yend;
+    int ypxl2 = floor(yend);
+    plot(sink, steep, xpxl2, ypxl2, rfpart(yend) * xgap, color);
+    plot(sink, steep, xpxl2, ypxl2 + 1, fpart(yend) * xgap, color);
+
+    // Draw the main portion of the line with anti-aliasing
+    for (int x = xpxl1 + 1; x <= xpxl2 - 1; x++) {
+        plot(sink, steep, x, floor(intery), rfpart(intery), color);
+        plot(sink, steep, x, floor(intery) + 1, fpart(intery), color);
+        intery += gradient; // Update y value for next iteration
+    }
+}
+
+void wu_line(int x0, int y0, int x1, int y1, ALLEGRO_COLOR color) {
+    allegro_sink sink;
+    wu_line(sink, x0, y0, x1, y1, color);
+}
+
+// ----------------------- Fixed-point Wu ------------------------ //
+// wu_line spends most of its time in floor() and in building a blended color for every pixel.
+// This version keeps the endpoints and the line position in 16.16 fixed point: the top 8 bits
+// of the fraction are directly the coverage of the lower pixel, which indexes the blend table.
+
+const int FIXED_SHIFT = 16;
+const int32_t FIXED_ONE = 1 << FIXED_SHIFT;
+const int32_t FIXED_HALF = FIXED_ONE >> 1;
+const int32_t FIXED_FRACTION = FIXED_ONE - 1;
+
+inline int32_t to_fixed(float f) {
+    return (int32_t)lrintf(f * FIXED_ONE);
+}
+
+// Plots the pixel pair straddling the 16.16 position y, the pair's total coverage given in 0..256
+template <class Sink>
+inline void plot_pair_fixed(Sink& sink, bool steep, int x, int32_t y, int32_t total, const wu_blend_lut& lut) {
+    int row = y >> FIXED_SHIFT;
+    int lower = (((y & FIXED_FRACTION) >> 8) * total) >> 8;  // coverage of row + 1
+    int upper = min(255, total - lower);
+    lower = min(255, lower);
     if (steep) {
-        plot(ypxl2, xpxl2, rfpart(yend) * xgap, color);
-        plot(ypxl2 + 1, xpxl2, fpart(yend) * xgap, color);
+        sink.blend(row, x, lut, upper);
+        sink.blend(row + 1, x, lut, lower);
+        STAT_PIXEL(row, x);
+        STAT_PIXEL(row + 1, x);
     } else {
-        plot(xpxl2, ypxl2, rfpart(yend) * xgap, color);
-        plot(xpxl2, ypxl2 + 1, fpart(yend) * xgap, color);
+        sink.blend(x, row, lut, upper);
+        sink.blend(x, row + 1, lut, lower);
+        STAT_PIXEL(x, row);
+        STAT_PIXEL(x, row + 1);
     }
+}
 
-    // Draw the main portion of the line with anti-aliasing
+/**
+ * Wu's antialiased line with subpixel endpoints, using only integer arithmetic per pixel.
+ * Produces the same pixels as wu_line for integer endpoints, up to 8-bit rounding of the coverage.
+ */
+template <class Sink>
+void wu_line_fixed(Sink& sink, float fx0, float fy0, float fx1, float fy1, const wu_blend_lut& lut) {
+    if (!clip_segment(fx0, fy0, fx1, fy1, sink.bounds(), 2)) {
+        STAT_CULLED();
+        return;
+    }
+    int32_t x0 = to_fixed(fx0), y0 = to_fixed(fy0);
+    int32_t x1 = to_fixed(fx1), y1 = to_fixed(fy1);
+
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    if (steep) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+
+    int32_t dx = x1 - x0;
+    int32_t dy = y1 - y0;
+    int32_t gradient = (dx == 0) ? FIXED_ONE : (int32_t)(((int64_t)dy << FIXED_SHIFT) / dx);
+
+    // First endpoint, covered by the part of the pixel after x0
+    int xpxl1 = (x0 + FIXED_HALF) >> FIXED_SHIFT;
+    int32_t yend = y0 + (int32_t)(((int64_t)gradient * (xpxl1 * FIXED_ONE - x0)) >> FIXED_SHIFT);
+    int32_t xgap = FIXED_ONE - ((x0 + FIXED_HALF) & FIXED_FRACTION);
+    plot_pair_fixed(sink, steep, xpxl1, yend, xgap >> 8, lut);
+    int32_t intery = yend + gradient;
+
+    // Second endpoint, covered by the part of the pixel before x1
+    int xpxl2 = (x1 + FIXED_HALF) >> FIXED_SHIFT;
+    yend = y1 + (int32_t)(((int64_t)gradient * (xpxl2 * FIXED_ONE - x1)) >> FIXED_SHIFT);
+    xgap = (x1 + FIXED_HALF) & FIXED_FRACTION;
+    plot_pair_fixed(sink, steep, xpxl2, yend, xgap >> 8, lut);
+
+    // Main portion of the line: the coverage of the lower pixel is the top byte of the fraction
     for (int x = xpxl1 + 1; x <= xpxl2 - 1; x++) {
+        int row = intery >> FIXED_SHIFT;
+        int lower = (intery & FIXED_FRACTION) >> 8;
         if (steep) {
-            plot((int)intery, x, rfpart(intery), color);
-            plot((int)intery + 1, x, fpart(intery), color);
+            sink.blend(row, x, lut, 255 - lower);
+            sink.blend(row + 1, x, lut, lower);
+            STAT_PIXEL(row, x);
+            STAT_PIXEL(row + 1, x);
         } else {
-            plot(x, (int)intery, rfpart(intery), color);
-            plot(x, (int)intery + 1, fpart(intery), color);
+            sink.blend(x, row, lut, 255 - lower);
+            sink.blend(x, row + 1, lut, lower);
+            STAT_PIXEL(x, row);
+            STAT_PIXEL(x, row + 1);
         }
-        intery += gradient; // Update y value for next iteration
+        intery += gradient;
     }
 }
 
-void measurePerformance(void (*lineAlgorithm)(int, int, int, int, ALLEGRO_COLOR), const char* algorithmName) {
-    // Define parameters for drawing a set of radial lines from a center point
-    int CX = 450;  // Center to make it not influence the drawing on screen
-    int CY = 150;
-    int R = 100;
-    int NUM_LINES = 1000;  // Increase this for more precision
-    float STEP = 2*3.14/NUM_LINES;
+// ----------------------- Batched drawing ------------------------ //
+// Every al_draw_pixel call goes through the Allegro driver separately, which is most of the cost
+// when thousands of lines are drawn per frame. The batched versions lock the part of the target
+// bitmap covered by the batch once, write straight into its memory and unlock at the end.
+// The Bresenham batch is drawn with the run-slice rasterizer, which writes whole runs at once.
+
+void bresenham_lines(const line_segment* lines, int count, ALLEGRO_COLOR color) {
+    locked_bitmap_sink sink;
+    if (!sink.lock(lines, count)) {
+        // Fall back to drawing pixel by pixel, e.g. when the target is already locked
+        for (int i = 0; i < count; i++) bresenham_line(lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        return;
+    }
+    uint32_t packed = pack_color(color);
+    for (int i = 0; i < count; i++) {
+        slice_line(sink, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, packed);
+    }
+    sink.unlock();
+}
+
+// The batched Wu lines use the fixed-point engine with one blend table for the whole batch
+void wu_lines(const line_segment* lines, int count, ALLEGRO_COLOR color) {
+    locked_bitmap_sink sink;
+    if (!sink.lock(lines, count)) {
+        for (int i = 0; i < count; i++) wu_line(lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        return;
+    }
+    wu_blend_lut lut(pack_color(color));
+    for (int i = 0; i < count; i++) {
+        wu_line_fixed(sink, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, lut);
+    }
+    sink.unlock();
+}
+
+void wu_lines(const line_segmentf* lines, int count, ALLEGRO_COLOR color) {
+    wu_blend_lut lut(pack_color(color));
+    locked_bitmap_sink sink;
+    if (!sink.lock(lines, count)) {
+        allegro_sink fallback;
+        for (int i = 0; i < count; i++) wu_line_fixed(fallback, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, lut);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        wu_line_fixed(sink, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, lut);
+    }
+    sink.unlock();
+}
+
+// ----------------------- SIMD multi-line Bresenham ------------------------ //
+// For large batches in a memory framebuffer, 8 independent lines are stepped at once, one per
+// vector lane. Each lane walks its line along the major axis and keeps an integer error term,
+// which steps the minor axis when it reaches half a pixel (the error >= 0.5 rule of bresenham_line).
+// Lines are grouped by major axis and sorted by length, so that the lanes of a group finish together.
+// AVX2 steps all 8 lanes in one register, SSE4.1 in two, otherwise a plain loop is used.
+
+const int SIMD_LANES = 8;
+
+#if defined(__AVX2__)
+typedef __m256i lanes;
+inline lanes lanes_load(const int32_t* p)         { return _mm256_load_si256((const __m256i*)p); }
+inline void lanes_store(int32_t* p, lanes a)      { _mm256_store_si256((__m256i*)p, a); }
+inline lanes lanes_set(int32_t i)                 { return _mm256_set1_epi32(i); }
+inline lanes lanes_add(lanes a, lanes b)          { return _mm256_add_epi32(a, b); }
+inline lanes lanes_sub(lanes a, lanes b)          { return _mm256_sub_epi32(a, b); }
+inline lanes lanes_mul(lanes a, lanes b)          { return _mm256_mullo_epi32(a, b); }
+inline lanes lanes_and(lanes a, lanes b)          { return _mm256_and_si256(a, b); }
+inline lanes lanes_gt(lanes a, lanes b)           { return _mm256_cmpgt_epi32(a, b); }
+inline int lanes_mask(lanes a)                    { return _mm256_movemask_ps(_mm256_castsi256_ps(a)); }
+inline void lanes_scatter(uint32_t* base, lanes offsets, uint32_t color) {
+    __m128i lo = _mm256_castsi256_si128(offsets), hi = _mm256_extracti128_si256(offsets, 1);
+    base[_mm_cvtsi128_si32(lo)] = color;    base[_mm_extract_epi32(lo, 1)] = color;
+    base[_mm_extract_epi32(lo, 2)] = color; base[_mm_extract_epi32(lo, 3)] = color;
+    base[_mm_cvtsi128_si32(hi)] = color;    base[_mm_extract_epi32(hi, 1)] = color;
+    base[_mm_extract_epi32(hi, 2)] = color; base[_mm_extract_epi32(hi, 3)] = color;
+}
+#elif defined(__SSE4_1__)
+struct lanes { __m128i lo, hi; };
+inline lanes lanes_load(const int32_t* p)         { lanes r = {_mm_load_si128((const __m128i*)p), _mm_load_si128((const __m128i*)p + 1)}; return r; }
+inline void lanes_store(int32_t* p, lanes a)      { _mm_store_si128((__m128i*)p, a.lo); _mm_store_si128((__m128i*)p + 1, a.hi); }
+inline lanes lanes_set(int32_t i)                 { lanes r = {_mm_set1_epi32(i), _mm_set1_epi32(i)}; return r; }
+inline lanes lanes_add(lanes a, lanes b)          { lanes r = {_mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi)}; return r; }
+inline lanes lanes_sub(lanes a, lanes b)          { lanes r = {_mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi)}; return r; }
+inline lanes lanes_mul(lanes a, lanes b)          { lanes r = {_mm_mullo_epi32(a.lo, b.lo), _mm_mullo_epi32(a.hi, b.hi)}; return r; }
+inline lanes lanes_and(lanes a, lanes b)          { lanes r = {_mm_and_si128(a.lo, b.lo), _mm_and_si128(a.hi, b.hi)}; return r; }
+inline lanes lanes_gt(lanes a, lanes b)           { lanes r = {_mm_cmpgt_epi32(a.lo, b.lo), _mm_cmpgt_epi32(a.hi, b.hi)}; return r; }
+inline int lanes_mask(lanes a) {
+    return _mm_movemask_ps(_mm_castsi128_ps(a.lo)) | (_mm_movemask_ps(_mm_castsi128_ps(a.hi)) << 4);
+}
+inline void lanes_scatter(uint32_t* base, lanes offsets, uint32_t color) {
+    base[_mm_cvtsi128_si32(offsets.lo)] = color;    base[_mm_extract_epi32(offsets.lo, 1)] = color;
+    base[_mm_extract_epi32(offsets.lo, 2)] = color; base[_mm_extract_epi32(offsets.lo, 3)] = color;
+    base[_mm_cvtsi128_si32(offsets.hi)] = color;    base[_mm_extract_epi32(offsets.hi, 1)] = color;
+    base[_mm_extract_epi32(offsets.hi, 2)] = color; base[_mm_extract_epi32(offsets.hi, 3)] = color;
+}
+#else
+struct lanes { int32_t v[SIMD_LANES]; };
+inline lanes lanes_load(const int32_t* p)         { lanes r; for (int i = 0; i < SIMD_LANES; i++) r.v[i] = p[i]; return r; }
+inline void lanes_store(int32_t* p, lanes a)      { for (int i = 0; i < SIMD_LANES; i++) p[i] = a.v[i]; }
+inline lanes lanes_set(int32_t x)                 { lanes r; for (int i = 0; i < SIMD_LANES; i++) r.v[i] = x; return r; }
+inline lanes lanes_add(lanes a, lanes b)          { for (int i = 0; i < SIMD_LANES; i++) a.v[i] = (uint32_t)a.v[i] + b.v[i]; return a; }
+inline lanes lanes_sub(lanes a, lanes b)          { for (int i = 0; i < SIMD_LANES; i++) a.v[i] = (uint32_t)a.v[i] - b.v[i]; return a; }
+inline lanes lanes_mul(lanes a, lanes b)          { for (int i = 0; i < SIMD_LANES; i++) a.v[i] = (uint32_t)a.v[i] * b.v[i]; return a; }
+inline lanes lanes_and(lanes a, lanes b)          { for (int i = 0; i < SIMD_LANES; i++) a.v[i] &= b.v[i]; return a; }
+inline lanes lanes_gt(lanes a, lanes b)           { for (int i = 0; i < SIMD_LANES; i++) a.v[i] = a.v[i] > b.v[i] ? -1 : 0; return a; }
+inline int lanes_mask(lanes a) {
+    int mask = 0;
+    for (int i = 0; i < SIMD_LANES; i++) if (a.v[i] < 0) mask |= 1 << i;
+    return mask;
+}
+inline void lanes_scatter(uint32_t* base, lanes offsets, uint32_t color) {
+    for (int i = 0; i < SIMD_LANES; i++) base[offsets.v[i]] = color;
+}
+#endif
+
+/**
+ * Per-lane state of a group of lines, laid out so that every field loads as one vector.
+ */
+struct line_lanes {
+    alignas(32) int32_t x[SIMD_LANES], y[SIMD_LANES];
+    alignas(32) int32_t error[SIMD_LANES];
+    alignas(32) int32_t remaining[SIMD_LANES];                  // Pixels left after the current one
+    alignas(32) int32_t majorX[SIMD_LANES], majorY[SIMD_LANES];  // Step along the major axis
+    alignas(32) int32_t minorX[SIMD_LANES], minorY[SIMD_LANES];  // Extra step when the error overflows
+    alignas(32) int32_t increment[SIMD_LANES];                  // 2 * minor delta
+    alignas(32) int32_t threshold[SIMD_LANES];                  // major delta - 1, the error steps when above it
+    alignas(32) int32_t decrement[SIMD_LANES];                  // 2 * major delta
+    int shortest, longest;                                      // Lengths of the shortest and longest line
+};
+
+/**
+ * Sets up a lane for the clipped steps of a line, so every pixel it visits is inside.
+ */
+void setup_lane(line_lanes& g, int i, const line_segment& l, const step_range& steps) {
+    int dx = abs(l.x2 - l.x1), dy = abs(l.y2 - l.y1);
+    int xStep = (l.x1 < l.x2) ? 1 : -1;
+    int yStep = (l.y1 < l.y2) ? 1 : -1;
+    bool horizontal = dx >= dy;
+    int moved, error;
+    bresenham_state(steps.first, horizontal ? dx : dy, horizontal ? dy : dx, moved, error);
+    g.x[i] = l.x1 + (horizontal ? steps.first : moved) * xStep;
+    g.y[i] = l.y1 + (horizontal ? moved : steps.first) * yStep;
+    g.error[i] = error;
+    g.remaining[i] = steps.last - steps.first;
+    g.majorX[i] = horizontal ? xStep : 0;
+    g.majorY[i] = horizontal ? 0 : yStep;
+    g.minorX[i] = horizontal ? 0 : xStep;
+    g.minorY[i] = horizontal ? yStep : 0;
+    g.increment[i] = 2 * (horizontal ? dy : dx);
+    g.threshold[i] = (horizontal ? dx : dy) - 1;
+    g.decrement[i] = 2 * (horizontal ? dx : dy);
+}
+
+/**
+ * Steps all lanes of a group until its longest line is done, scattering the pixels.
+ * The lines are clipped, so the lanes step pixel offsets directly and every lane writes
+ * until the shortest line ends; after that only the lanes with pixels left.
+ */
+void rasterize_lanes(framebuffer_sink& fb, const line_lanes& g, uint32_t color) {
+    lanes error = lanes_load(g.error), remaining = lanes_load(g.remaining);
+    lanes increment = lanes_load(g.increment), threshold = lanes_load(g.threshold), decrement = lanes_load(g.decrement);
+    lanes minusOne = lanes_set(-1), one = lanes_set(1);
+    lanes width = lanes_set(fb.width);
+    lanes x = lanes_load(g.x), y = lanes_load(g.y);
+    lanes majorX = lanes_load(g.majorX), majorY = lanes_load(g.majorY);
+    lanes minorX = lanes_load(g.minorX), minorY = lanes_load(g.minorY);
+    alignas(32) int32_t offsets[SIMD_LANES];
+
+    lanes offset = lanes_add(lanes_mul(y, width), x);
+    lanes major = lanes_add(lanes_mul(majorY, width), majorX);
+    lanes minor = lanes_add(lanes_mul(minorY, width), minorX);
+    for (int step = 0; step <= g.longest; step++) {
+        if (step <= g.shortest) {
+            lanes_scatter(fb.pixels, offset, color);
+        } else {
+            lanes_store(offsets, offset);
+            int mask = lanes_mask(lanes_gt(remaining, minusOne));
+            while (mask) {
+                int i = __builtin_ctz(mask);
+                fb.pixels[offsets[i]] = color;
+                mask &= mask - 1;
+            }
+        }
+        // error += 2 * dminor; if (error >= dmajor) step the minor axis and error -= 2 * dmajor
+        error = lanes_add(error, increment);
+        lanes overflow = lanes_gt(error, threshold);
+        offset = lanes_add(offset, lanes_add(major, lanes_and(overflow, minor)));
+        error = lanes_sub(error, lanes_and(overflow, decrement));
+        remaining = lanes_sub(remaining, one);
+    }
+}
+
+/**
+ * Draws a batch of lines into a memory framebuffer, 8 at a time.
+ * Gives the same pixels as calling bresenham_line with an integer error term for every line.
+ */
+void bresenham_lines_simd(framebuffer_sink& fb, const line_segment* lines, int count, uint32_t color) {
+    // Clip first, lines entirely outside are dropped
+    vector<step_range> steps(count);
+    vector<int> visible;
+    visible.reserve(count);
+    for (int i = 0; i < count; i++) {
+        const line_segment& l = lines[i];
+        if (clip_steps(l.x1, l.y1, l.x2, l.y2, fb.bounds(), steps[i])) visible.push_back(i);
+    }
+    count = visible.size();
+
+    // Horizontal-major lines first, then vertical-major ones, each ordered by clipped length.
+    // A counting sort over (axis, length) buckets, lines longer than the last bucket share it.
+    const int LENGTH_BUCKETS = 1024;
+    vector<int> bucketStart(2 * LENGTH_BUCKETS + 1, 0);
+    vector<int> bucket(count);
+    for (int i = 0; i < count; i++) {
+        const line_segment& l = lines[visible[i]];
+        bool vertical = abs(l.x2 - l.x1) < abs(l.y2 - l.y1);
+        const step_range& s = steps[visible[i]];
+        bucket[i] = (vertical ? LENGTH_BUCKETS : 0) + min(s.last - s.first, LENGTH_BUCKETS - 1);
+        bucketStart[bucket[i] + 1]++;
+    }
+    for (int b = 0; b < 2 * LENGTH_BUCKETS; b++) bucketStart[b + 1] += bucketStart[b];
+    vector<int> order(count);
+    for (int i = 0; i < count; i++) order[bucketStart[bucket[i]]++] = visible[i];
+
+    line_lanes group;
+    for (int first = 0; first < count; first += SIMD_LANES) {
+        group.shortest = INT32_MAX;
+        group.longest = 0;
+        for (int i = 0; i < SIMD_LANES; i++) {
+            // A short last group repeats its first line in the unused lanes, which writes the same pixels again
+            int line = order[first + i < count ? first + i : first];
+            const step_range& s = steps[line];
+            setup_lane(group, i, lines[line], s);
+            group.shortest = min(group.shortest, s.last - s.first);
+            group.longest = max(group.longest, s.last - s.first);
+        }
+        rasterize_lanes(fb, group, color);
+    }
+}
+
+// ----------------------- Tiled multithreaded rendering ------------------------ //
+// Lines are binned into 64x64 screen tiles and a pool of worker threads rasterizes whole tiles.
+// Every tile belongs to exactly one worker at a time, so the shared framebuffer needs no locks,
+// and the lines of a tile are drawn in the order they were added, so the result does not depend
+// on the number of threads.
+
+const int TILE_SIZE = 64;
+
+/**
+ * A fixed set of threads that run the same task over a range of indices.
+ * The calling thread works along, so a pool of one thread runs everything in place.
+ */
+class worker_pool {
+public:
+    worker_pool(int threads = 0) {
+        if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+        for (int i = 1; i < threads; i++) workers.push_back(thread(&worker_pool::work, this));
+    }
+    ~worker_pool() {
+        {
+            lock_guard<mutex> lock(m);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    /**
+     * Calls task(i) for every i in [0, count) on all threads and returns when all are done.
+     */
+    void run(int count, const function<void(int)>& task) {
+        {
+            lock_guard<mutex> lock(m);
+            current = &task;
+            total = count;
+            next = 0;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        drain();
+        unique_lock<mutex> lock(m);
+        done.wait(lock, [this] { return busy == 0; });
+    }
+
+private:
+    vector<thread> workers;
+    mutex m;
+    condition_variable wake, done;
+    const function<void(int)>* current = NULL;
+    int total = 0;
+    atomic<int> next{0};
+    int busy = 0;
+    int generation = 0;
+    bool quit = false;
+
+    void drain() {
+        for (int i = next++; i < total; i = next++) (*current)(i);
+    }
+    void work() {
+        int seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> lock(m);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit) return;
+                seen = generation;
+            }
+            drain();
+            lock_guard<mutex> lock(m);
+            if (--busy == 0) done.notify_one();
+        }
+    }
+};
+
+/**
+ * Collects the lines of a frame into tile bins and renders them on a worker pool.
+ */
+struct tile_renderer {
+    framebuffer_sink& fb;
+    int tilesX, tilesY;
+    vector<line_segment> lines;
+    vector<uint32_t> colors;
+    vector<vector<int> > bins;  // Indices of the lines touching each tile, in the order they were added
+
+    tile_renderer(framebuffer_sink& fb): fb(fb) {
+        tilesX = (fb.width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (fb.height + TILE_SIZE - 1) / TILE_SIZE;
+        bins.resize(tilesX * tilesY);
+    }
+
+    clip_rect tile_rect(int tile) const {
+        clip_rect r;
+        r.x0 = (tile % tilesX) * TILE_SIZE;
+        r.y0 = (tile / tilesX) * TILE_SIZE;
+        r.x1 = min(r.x0 + TILE_SIZE, fb.width) - 1;
+        r.y1 = min(r.y0 + TILE_SIZE, fb.height) - 1;
+        return r;
+    }
+
+    /**
+     * Adds the line to the bins of the tiles it passes through. The line is cut at every tile
+     * column (or row, for steep lines) and the minor coordinate at both ends of each piece gives
+     * the tiles the piece covers.
+     */
+    void add_line(const line_segment& l, uint32_t color) {
+        step_range steps;
+        if (!clip_steps(l.x1, l.y1, l.x2, l.y2, fb.bounds(), steps)) {
+            STAT_CULLED();
+            return;
+        }
+        int index = lines.size();
+        lines.push_back(l);
+        colors.push_back(color);
+
+        int dx = abs(l.x2 - l.x1), dy = abs(l.y2 - l.y1);
+        bool horizontal = dx >= dy;
+        int majorDelta = horizontal ? dx : dy, minorDelta = horizontal ? dy : dx;
+        int majorStart = horizontal ? l.x1 : l.y1, minorStart = horizontal ? l.y1 : l.x1;
+        int majorStep = (horizontal ? l.x1 < l.x2 : l.y1 < l.y2) ? 1 : -1;
+        int minorStep = (horizontal ? l.y1 < l.y2 : l.x1 < l.x2) ? 1 : -1;
+        int majorTiles = horizontal ? tilesX : tilesY, minorTiles = horizontal ? tilesY : tilesX;
+
+        int k = steps.first;
+        while (k <= steps.last) {
+            int major = majorStart + k * majorStep;
+            int tile = major >= 0 ? major / TILE_SIZE : -1;
+            // Last step that stays in this tile column
+            int boundary = majorStep > 0 ? (tile + 1) * TILE_SIZE - 1 : tile * TILE_SIZE;
+            int end = min(steps.last, k + abs(boundary - major));
+            if (tile >= 0 && tile < majorTiles) {
+                int64_t movedA = majorDelta ? (2 * (int64_t)k * minorDelta + majorDelta) / (2 * (int64_t)majorDelta) : 0;
+                int64_t movedB = majorDelta ? (2 * (int64_t)end * minorDelta + majorDelta) / (2 * (int64_t)majorDelta) : 0;
+                int minorA = minorStart + (int)movedA * minorStep, minorB = minorStart + (int)movedB * minorStep;
+                int from = max(0, min(minorA, minorB)), to = min(minorTiles * TILE_SIZE - 1, max(minorA, minorB));
+                for (int t = from / TILE_SIZE; from <= to && t <= to / TILE_SIZE; t++) {
+                    bins[horizontal ? t * tilesX + tile : tile * tilesX + t].push_back(index);
+                }
+            }
+            k = end + 1;
+        }
+    }
+
+    /**
+     * Draws all tiles in parallel, then forgets the lines for the next frame.
+     */
+    void render(worker_pool& pool) {
+        pool.run(bins.size(), [this](int tile) {
+            clip_rect r = tile_rect(tile);
+            const vector<int>& bin = bins[tile];
+            for (size_t i = 0; i < bin.size(); i++) {
+                const line_segment& l = lines[bin[i]];
+                bresenham_line_clipped(fb, l.x1, l.y1, l.x2, l.y2, colors[bin[i]], r);
+            }
+        });
+        lines.clear();
+        colors.clear();
+        for (size_t i = 0; i < bins.size(); i++) bins[i].clear();
+    }
+};
+
+// ----------------------- Benchmark ------------------------ //
+// Run as "lines --bench [options]" to time the rasterizers headless against a memory framebuffer:
+//   --reps N          timed repetitions per workload and algorithm (default 30)
+//   --warmup N        untimed repetitions before that (default 3)
+//   --json FILE       write the results as JSON
+//   --csv FILE        write the results as CSV, which can later serve as a baseline
+//   --baseline FILE   compare the medians against an earlier CSV
+//   --threshold PCT   slowdown above which a result counts as a regression (default 10)
+// The exit code is 1 if any result regressed against the baseline.
 
-    auto start = std::chrono::high_resolution_clock::now();
+const int BENCH_WIDTH = 900;
+const int BENCH_HEIGHT = 300;
 
+struct bench_workload {
+    const char* name;
+    vector<line_segment> lines;
+};
+
+struct bench_algorithm {
+    const char* name;
+    function<void(framebuffer_sink&, const vector<line_segment>&)> draw;
+    function<long long(const vector<line_segment>&)> count; // Pixels touched by one run
+};
+
+struct bench_result {
+    string workload, algorithm;
+    int lines;
+    long long pixels;
+    double median, p95, p99;    // Nanoseconds per run
+    double nsPerPixel, linesPerSecond;
+};
+
+/**
+ * Small deterministic generator, so that every build benchmarks exactly the same lines.
+ */
+struct bench_random {
+    uint32_t state;
+    bench_random(uint32_t seed): state(seed) {};
+    int next(int n) {
+        state = state * 1664525u + 1013904223u;
+        return (int)((state >> 8) % (uint32_t)n);
+    }
+};
+
+/**
+ * Lines starting anywhere on the framebuffer with a major axis length in [minLength, maxLength]
+ * and a slope of at most maxSlope. steep picks the axis, -1 for either.
+ */
+bench_workload random_lines(const char* name, int count, int minLength, int maxLength, int steep, float maxSlope, uint32_t seed) {
+    bench_random rnd(seed);
+    bench_workload w;
+    w.name = name;
+    for (int i = 0; i < count; i++) {
+        bool isSteep = steep < 0 ? rnd.next(2) == 1 : steep == 1;
+        int major = minLength + rnd.next(maxLength - minLength + 1);
+        int minor = rnd.next((int)(major * maxSlope) + 1);
+        int dx = isSteep ? minor : major, dy = isSteep ? major : minor;
+        if (rnd.next(2)) dx = -dx;
+        if (rnd.next(2)) dy = -dy;
+        int x1 = rnd.next(BENCH_WIDTH), y1 = rnd.next(BENCH_HEIGHT);
+        // Keep the lines on the framebuffer by mirroring those that would leave it
+        if (x1 + dx < 0 || x1 + dx >= BENCH_WIDTH) dx = -dx;
+        if (y1 + dy < 0 || y1 + dy >= BENCH_HEIGHT) dy = -dy;
+        line_segment l = {x1, y1, max(0, min(BENCH_WIDTH - 1, x1 + dx)), max(0, min(BENCH_HEIGHT - 1, y1 + dy))};
+        w.lines.push_back(l);
+    }
+    return w;
+}
+
+/**
+ * Lines through a point on the framebuffer that run far past it at both ends, as from a zoomed in view.
+ */
+bench_workload offscreen_lines(int count, uint32_t seed) {
+    bench_random rnd(seed);
+    bench_workload w;
+    w.name = "offscreen";
+    for (int i = 0; i < count; i++) {
+        int x = rnd.next(BENCH_WIDTH), y = rnd.next(BENCH_HEIGHT);
+        int dx = rnd.next(20001) - 10000, dy = rnd.next(20001) - 10000;
+        line_segment l = {x - dx, y - dy, x + dx, y + dy};
+        w.lines.push_back(l);
+    }
+    return w;
+}
+
+/**
+ * The workload of the old measurePerformance: a fan of radial lines.
+ */
+bench_workload radial_lines() {
+    const int CX = 450, CY = 150, R = 100, NUM_LINES = 1000;
+    float STEP = 2*3.14/NUM_LINES;
+    bench_workload w;
+    w.name = "radial";
     for (int i = 0; i < NUM_LINES; i++) {
-        lineAlgorithm(CX, CY, CX + (int)(R*cos(STEP*i)), CY + (int)(R*sin(STEP*i)), al_map_rgb(255, 255, 255));  // Using white to make sure it doesn't visibly influence the drawing
+        line_segment l = {CX, CY, CX + (int)(R*cos(STEP*i)), CY + (int)(R*sin(STEP*i))};
+        w.lines.push_back(l);
+    }
+    return w;
+}
+
+// Value below which the given fraction of the sorted samples lies
+double percentile(const vector<double>& sorted, double fraction) {
+    size_t i = (size_t)ceil(fraction * sorted.size());
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+bench_result run_case(const bench_workload& w, const bench_algorithm& a, vector<uint32_t>& pixels, int warmup, int reps) {
+    framebuffer_sink fb(&pixels[0], BENCH_WIDTH, BENCH_HEIGHT);
+    vector<double> samples;
+    for (int r = 0; r < warmup + reps; r++) {
+        fill(pixels.begin(), pixels.end(), 0xFFFFFFFF);
+        auto start = chrono::steady_clock::now();
+        a.draw(fb, w.lines);
+        auto end = chrono::steady_clock::now();
+        if (r >= warmup) samples.push_back(chrono::duration<double, nano>(end - start).count());
+    }
+    sort(samples.begin(), samples.end());
+
+    bench_result result;
+    result.workload = w.name;
+    result.algorithm = a.name;
+    result.lines = w.lines.size();
+    result.pixels = a.count(w.lines);
+    result.median = percentile(samples, 0.5);
+    result.p95 = percentile(samples, 0.95);
+    result.p99 = percentile(samples, 0.99);
+    result.nsPerPixel = result.pixels ? result.median / result.pixels : 0;
+    result.linesPerSecond = result.median > 0 ? result.lines * 1e9 / result.median : 0;
+    return result;
+}
+
+void write_csv(const char* file, const vector<bench_result>& results) {
+    FILE* f = fopen(file, "w");
+    if (!f) { cerr << "Could not write " << file << endl; return; }
+    fprintf(f, "workload,algorithm,lines,pixels,median_ns,p95_ns,p99_ns,ns_per_pixel,lines_per_second\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result& r = results[i];
+        fprintf(f, "%s,%s,%d,%lld,%.0f,%.0f,%.0f,%.4f,%.0f\n", r.workload.c_str(), r.algorithm.c_str(),
+                r.lines, r.pixels, r.median, r.p95, r.p99, r.nsPerPixel, r.linesPerSecond);
+    }
+    fclose(f);
+}
+
+void write_json(const char* file, const vector<bench_result>& results) {
+    FILE* f = fopen(file, "w");
+    if (!f) { cerr << "Could not write " << file << endl; return; }
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const bench_result& r = results[i];
+        fprintf(f, "  {\"workload\": \"%s\", \"algorithm\": \"%s\", \"lines\": %d, \"pixels\": %lld, "
+                   "\"median_ns\": %.0f, \"p95_ns\": %.0f, \"p99_ns\": %.0f, \"ns_per_pixel\": %.4f, \"lines_per_second\": %.0f}%s\n",
+                r.workload.c_str(), r.algorithm.c_str(), r.lines, r.pixels, r.median, r.p95, r.p99,
+                r.nsPerPixel, r.linesPerSecond, i + 1 < results.size() ? "," : "");
     }
+    fprintf(f, "]\n");
+    fclose(f);
+}
 
-    auto end = std::chrono::high_resolution_clock::now();
-    // Calculate the elapsed time in milliseconds
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+/**
+ * Compares the medians against a CSV written by an earlier run and returns the number of regressions.
+ * Cases missing from the baseline are skipped.
+ */
+int compare_baseline(const char* file, const vector<bench_result>& results, double threshold) {
+    FILE* f = fopen(file, "r");
+    if (!f) { cerr << "Could not read baseline " << file << endl; return 0; }
+    char line[512];
+    int regressions = 0;
+    if (!fgets(line, sizeof(line), f)) { fclose(f); return 0; }  // Header, an empty file has no baseline
+    while (fgets(line, sizeof(line), f)) {
+        char workload[128], algorithm[128];
+        double median;
+        if (sscanf(line, "%127[^,],%127[^,],%*d,%*d,%lf", workload, algorithm, &median) != 3) continue;
+        for (size_t i = 0; i < results.size(); i++) {
+            const bench_result& r = results[i];
+            if (r.workload != workload || r.algorithm != algorithm) continue;
+            double change = (r.median - median) / median * 100;
+            if (change > threshold) {
+                printf("REGRESSION %s/%s: %.0f ns -> %.0f ns (%+.1f%%)\n", workload, algorithm, median, r.median, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    return regressions;
+}
 
-    cout << algorithmName << " took: " << duration << " ms for " << NUM_LINES << " lines." << endl;
+int run_benchmark(int argc, char** argv) {
+    int reps = 30, warmup = 3;
+    double threshold = 10;
+    const char *jsonFile = NULL, *csvFile = NULL, *baselineFile = NULL;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--reps" && hasValue) reps = max(1, atoi(argv[++i]));
+        else if (arg == "--warmup" && hasValue) warmup = max(0, atoi(argv[++i]));
+        else if (arg == "--json" && hasValue) jsonFile = argv[++i];
+        else if (arg == "--csv" && hasValue) csvFile = argv[++i];
+        else if (arg == "--baseline" && hasValue) baselineFile = argv[++i];
+        else if (arg == "--threshold" && hasValue) threshold = atof(argv[++i]);
+        else if (arg != "--bench") cerr << "Ignoring unknown option " << arg << endl;
+    }
+
+    vector<bench_workload> workloads;
+    workloads.push_back(random_lines("short", 20000, 1, 8, -1, 1, 1));
+    workloads.push_back(random_lines("long", 1000, 200, 299, -1, 1, 2));
+    workloads.push_back(random_lines("steep", 2000, 50, 299, 1, 1, 3));
+    workloads.push_back(random_lines("shallow", 2000, 50, 299, 0, 1, 4));
+    workloads.push_back(random_lines("flat", 2000, 100, 899, 0, 0.1f, 5));  // Plot-like near-horizontal lines
+    workloads.push_back(offscreen_lines(200, 6));
+    workloads.push_back(radial_lines());
+
+    const uint32_t color = 0xFF000000;
+    wu_blend_lut lut(color);
+    const clip_rect screen = {0, 0, BENCH_WIDTH - 1, BENCH_HEIGHT - 1};
+    worker_pool pool;
+
+    vector<bench_algorithm> algorithms;
+    algorithms.push_back({"bresenham",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            for (size_t i = 0; i < lines.size(); i++) bresenham_line(fb, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        },
+        [&](const vector<line_segment>& lines) {
+            counting_sink c(screen);
+            for (size_t i = 0; i < lines.size(); i++) bresenham_line(c, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+            return c.pixels;
+        }});
+    algorithms.push_back({"bresenham_symmetric",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            for (size_t i = 0; i < lines.size(); i++) bresenham_line_symmetric(fb, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        },
+        algorithms[0].count});
+    algorithms.push_back({"slice",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            for (size_t i = 0; i < lines.size(); i++) slice_line(fb, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        },
+        algorithms[0].count});
+    algorithms.push_back({"wu",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            for (size_t i = 0; i < lines.size(); i++) wu_line(fb, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+        },
+        [&](const vector<line_segment>& lines) {
+            counting_sink c(screen);
+            for (size_t i = 0; i < lines.size(); i++) wu_line(c, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, color);
+            return c.pixels;
+        }});
+    algorithms.push_back({"wu_fixed",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            for (size_t i = 0; i < lines.size(); i++) wu_line_fixed(fb, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, lut);
+        },
+        [&](const vector<line_segment>& lines) {
+            counting_sink c(screen);
+            for (size_t i = 0; i < lines.size(); i++) wu_line_fixed(c, lines[i].x1, lines[i].y1, lines[i].x2, lines[i].y2, lut);
+            return c.pixels;
+        }});
+    // The lane-parallel and tiled paths draw the same pixels as bresenham
+    algorithms.push_back({"bresenham_simd",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            bresenham_lines_simd(fb, &lines[0], lines.size(), color);
+        },
+        algorithms[0].count});
+    algorithms.push_back({"tiled",
+        [&](framebuffer_sink& fb, const vector<line_segment>& lines) {
+            tile_renderer tiles(fb);
+            for (size_t i = 0; i < lines.size(); i++) tiles.add_line(lines[i], color);
+            tiles.render(pool);
+        },
+        algorithms[0].count});
+
+    vector<uint32_t> pixels(BENCH_WIDTH * BENCH_HEIGHT);
+    vector<bench_result> results;
+    printf("%d repetitions after %d warmup runs, %d thread(s) for the tiled renderer\n\n", reps, warmup, pool.size());
+    printf("%-10s %-20s %8s %10s %12s %12s %12s %10s %14s\n",
+           "workload", "algorithm", "lines", "pixels", "median ns", "p95 ns", "p99 ns", "ns/pixel", "lines/s");
+    for (size_t w = 0; w < workloads.size(); w++) {
+        for (size_t a = 0; a < algorithms.size(); a++) {
+            bench_result r = run_case(workloads[w], algorithms[a], pixels, warmup, reps);
+            printf("%-10s %-20s %8d %10lld %12.0f %12.0f %12.0f %10.3f %14.0f\n", r.workload.c_str(), r.algorithm.c_str(),
+                   r.lines, r.pixels, r.median, r.p95, r.p99, r.nsPerPixel, r.linesPerSecond);
+            results.push_back(r);
+#ifdef RASTER_STATS
+            // The timings include the counting, so the counts come from one more run of their own
+            stats.reset(BENCH_WIDTH, BENCH_HEIGHT);
+            framebuffer_sink fb(&pixels[0], BENCH_WIDTH, BENCH_HEIGHT);
+            algorithms[a].draw(fb, workloads[w].lines);
+            stats.print(stdout);
+#endif
+        }
+    }
+
+    if (jsonFile) write_json(jsonFile, results);
+    if (csvFile) write_csv(csvFile, results);
+    if (baselineFile) {
+        int regressions = compare_baseline(baselineFile, results, threshold);
+        printf("\n%d regression(s) above %.1f%% against %s\n", regressions, threshold, baselineFile);
+        if (regressions > 0) return 1;
+    }
+    return 0;
 }
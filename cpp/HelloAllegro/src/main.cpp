@@ -13,11 +13,14 @@ using namespace std;
 #include <allegro5/allegro_color.h>
 
 #include <cmath>
+#include <stdlib.h>
+#include <string>
 
 // ---------------------------- Global variables -------------------------- //
 ALLEGRO_DISPLAY*    display;
 ALLEGRO_EVENT_QUEUE* event_queue;
 ALLEGRO_EVENT       event;
+double              max_fps = 0;    // Redraws per second for animated content, 0 redraws only when needed
 
 // ---------------------------- Forward declarations -------------------------- //
 void init();
@@ -29,7 +32,12 @@ void drawTriangle(int x, int y);
 // ---------------------------- Main -------------------------- //
 // The overall structure of our program is the familiar GUI event loop:
 
-int main(){
+int main(int argc, char** argv){
+    // "--fps N" redraws N times a second
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--fps" && i + 1 < argc) max_fps = atof(argv[++i]);
+    }
+
     init();         // Initialize Allegro.
     event_loop();   // Run the event processing loop until a program is requested to quit
     deinit();       // Deinitialize
@@ -43,6 +51,8 @@ int main(){
 
 void init() {
     al_init();
+    // Expose events tell when the window has to be drawn again, see event_loop
+    al_set_new_display_flags(ALLEGRO_WINDOWED | ALLEGRO_RESIZABLE | ALLEGRO_GENERATE_EXPOSE_EVENTS);
     display = al_create_display(640, 480);
     event_queue = al_create_event_queue();
     al_register_event_source(event_queue, al_get_display_event_source(display));
@@ -61,16 +71,46 @@ void deinit() {
 
 // ---------------------------- Event loop -------------------------- //
 
+// The scene only changes when something happens, so instead of redrawing on a fixed period
+// the loop sleeps in al_wait_for_event and marks the frame dirty when the window was exposed,
+// resized or got input, and with max_fps above 0 on every tick of a timer for animated scenes.
+// A frame is drawn once the queue is empty, so a burst of events costs a single redraw.
+
 void event_loop() {
-    while(1) {
-        // We only need events to close the app when necessary
-        bool have_event = al_wait_for_event_timed(event_queue, &event, 0.05);
-        if (have_event) {
-            if (event.type == ALLEGRO_EVENT_DISPLAY_CLOSE || event.type == ALLEGRO_EVENT_KEY_UP) break;
+    ALLEGRO_TIMER* timer = NULL;
+    if (max_fps > 0) {
+        timer = al_create_timer(1.0 / max_fps);
+        al_register_event_source(event_queue, al_get_timer_event_source(timer));
+        al_start_timer(timer);
+    }
+
+    bool dirty = true;  // The first frame
+    bool quit = false;
+    while (!quit) {
+        if (dirty && al_is_event_queue_empty(event_queue)) {
+            draw();
+            dirty = false;
         }
-        // Draw the scene
-        draw();
-   }
+        al_wait_for_event(event_queue, &event);
+        switch (event.type) {
+        case ALLEGRO_EVENT_DISPLAY_CLOSE:
+        case ALLEGRO_EVENT_KEY_UP:
+            quit = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_RESIZE:
+            al_acknowledge_resize(display);
+            dirty = true;
+            break;
+        case ALLEGRO_EVENT_DISPLAY_EXPOSE:
+        case ALLEGRO_EVENT_DISPLAY_SWITCH_IN:
+        case ALLEGRO_EVENT_KEY_DOWN:        // Input
+        case ALLEGRO_EVENT_TIMER:
+            dirty = true;
+            break;
+        }
+    }
+
+    if (timer) al_destroy_timer(timer);
 }
 
 // ---------------------------- Drawing routines -------------------------- //
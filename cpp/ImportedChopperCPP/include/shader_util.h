@@ -7,11 +7,114 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <cstring>
+#include <cstdio>
 #include <GLEW/glew.h>
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 #include <glm/gtc/type_ptr.hpp>
 
+// Where linked program binaries are kept between runs. Define as "" to always compile from source.
+#ifndef SHADER_CACHE_DIR
+#define SHADER_CACHE_DIR "shader_cache"
+#endif
+
+/**
+ * An active uniform or attribute of a linked program, as glGetActiveUniform / glGetActiveAttrib
+ * report it. Arrays are known by their name without "[0]".
+ */
+struct shader_variable {
+    std::string name;
+    GLint location;
+    GLenum type;
+    GLint size;                         // Number of array elements, 1 for plain variables
+    std::vector<unsigned char> value;   // Last uploaded value of a uniform, empty before the first
+
+    // Remembers the value and tells whether it differs from the one uploaded last
+    bool update(const void* data, size_t bytes) {
+        if (value.size() == bytes && memcmp(&value[0], data, bytes) == 0) return false;
+        value.assign((const unsigned char*)data, (const unsigned char*)data + bytes);
+        return true;
+    }
+};
+
+// Uploads a uniform unless it already holds the value. The program must be active.
+inline void set_uniform(shader_variable& u, int i) {
+    if (u.update(&i, sizeof(i))) glUniform1i(u.location, i);
+}
+inline void set_uniform(shader_variable& u, float f) {
+    if (u.update(&f, sizeof(f))) glUniform1f(u.location, f);
+}
+inline void set_uniform(shader_variable& u, const glm::vec2& v) {
+    if (u.update(&v, sizeof(v))) glUniform2fv(u.location, 1, glm::value_ptr(v));
+}
+inline void set_uniform(shader_variable& u, const glm::vec3& v) {
+    if (u.update(&v, sizeof(v))) glUniform3fv(u.location, 1, glm::value_ptr(v));
+}
+inline void set_uniform(shader_variable& u, const glm::vec4& v) {
+    if (u.update(&v, sizeof(v))) glUniform4fv(u.location, 1, glm::value_ptr(v));
+}
+inline void set_uniform(shader_variable& u, const glm::mat4& m) {
+    if (u.update(&m, sizeof(m))) glUniformMatrix4fv(u.location, 1, GL_FALSE, glm::value_ptr(m));
+}
+inline void set_uniform(shader_variable& u, const std::vector<glm::mat4>& matrices) {
+    if (!matrices.empty() && u.update(&matrices[0], sizeof(glm::mat4) * matrices.size())) {
+        glUniformMatrix4fv(u.location, matrices.size(), GL_FALSE, &matrices[0][0][0]);
+    }
+}
+
+// The GLSL type a uniform set from T has; ints also go to bools and samplers
+inline GLenum uniform_type(const int*) { return GL_INT; }
+inline GLenum uniform_type(const float*) { return GL_FLOAT; }
+inline GLenum uniform_type(const glm::vec2*) { return GL_FLOAT_VEC2; }
+inline GLenum uniform_type(const glm::vec3*) { return GL_FLOAT_VEC3; }
+inline GLenum uniform_type(const glm::vec4*) { return GL_FLOAT_VEC4; }
+inline GLenum uniform_type(const glm::mat4*) { return GL_FLOAT_MAT4; }
+inline GLenum uniform_type(const std::vector<glm::mat4>*) { return GL_FLOAT_MAT4; }
+
+/**
+ * A uniform of type T looked up once, for the uniforms set every frame or for every object.
+ * Setting it costs no name lookup, and no GL call if the value did not change. A handle of a
+ * uniform the program does not have does nothing. Handles stay valid until the program is
+ * linked again.
+ */
+template <class T>
+class uniform_handle {
+private:
+    shader_variable* variable;
+public:
+    uniform_handle(shader_variable* variable = NULL): variable(variable) {}
+    // The program must be active
+    void set(const T& value) {
+        if (variable) set_uniform(*variable, value);
+    }
+    bool valid() const {
+        return variable != NULL;
+    }
+};
+
+/**
+ * A std140 uniform block shared by every program that declares it. Each program binds the block
+ * once to the buffer's binding point (shader_prog::uniformBlock), after which the contents are
+ * written once per update() no matter how many programs read them.
+ */
+class uniform_buffer {
+private:
+    GLuint buffer, binding;
+    GLsizeiptr size;
+public:
+    uniform_buffer(GLuint binding, GLsizeiptr size);
+    void create();                  // Needs the GL context
+    void update(const void* data);  // Replaces the whole block, data must be std140 laid out
+    void free();
+    GLuint getBinding() const {
+        return binding;
+    }
+};
+
+// #defines a shader is specialized with, name -> value
+typedef std::map<std::string, std::string> shader_defines;
 
 /**
  * Modified version of code from:
@@ -20,16 +123,51 @@
 class shader_prog {
 private:
     GLuint vertex_shader, fragment_shader, prog;
+    std::string v_filename, f_filename;  // Empty for the default shaders
     std::string v_source, f_source;
+    std::vector<std::string> v_files, f_files;  // File of each #line source string number, for error messages
+    shader_defines defines;
+    std::map<std::string, shader_prog*> variants;   // Keyed by the #define block
+    std::map<std::string, GLuint> blockBindings;    // Uniform blocks bound with uniformBlock()
+    std::string cacheFile;
+    bool loaded = false;      // Sources read
+    bool pending = false;     // Submitted to the driver, link status not checked yet
+    bool fromBinary = false;  // Linked from the program binary cache
     int textureCounter = 0;
+    std::map<std::string, shader_variable> uniforms, attributes;  // Filled in by use()
+
+    void load();
+    void submit();
+    void link();
+    void finish();
+    void ready();
+    void introspect();
+    shader_variable* findUniform(const char* name);
 public:
-    shader_prog(const char* vertex_shader_filename, const char* fragment_shader_filename);
+    shader_prog(const char* vertex_shader_filename, const char* fragment_shader_filename,
+                const shader_defines& defines = shader_defines());
     void use();
+    // Compiles all the programs at once without waiting for any. Each is checked on first use.
+    static void submitAll(const std::vector<shader_prog*>& programs);
+    // The same shaders specialized with more #defines. Compiled on the first request, then cached.
+    shader_prog* variant(const shader_defines& defines);
     void activate();
     void free();
     operator GLuint();
 
-    // Shorthands for glUniform specification
+    // Active uniforms and attributes of the linked program
+    const std::map<std::string, shader_variable>& activeUniforms() const {
+        return uniforms;
+    }
+    const std::map<std::string, shader_variable>& activeAttributes() const {
+        return attributes;
+    }
+    GLint attributeLocation(const char* name);
+    template <class T>
+    uniform_handle<T> uniformHandle(const char* name);
+    void uniformBlock(const char* name, const uniform_buffer& buffer);
+
+    // Shorthands for glUniform specification, skipping values the uniform already holds
     void uniform1i(const char* name, int i);
     void uniform1f(const char* name, float f);
     void uniform3f(const char* name, float x, float y, float z);
@@ -52,4 +190,13 @@ public:
     }
 };
 
+template <class T>
+uniform_handle<T> shader_prog::uniformHandle(const char* name) {
+    shader_variable* u = findUniform(name);
+    if (u && u->type != uniform_type((const T*)NULL) && uniform_type((const T*)NULL) != GL_INT) {
+        printf("WARNING: Uniform %s is set with a value of a different type.\n", name);
+    }
+    return uniform_handle<T>(u);
+}
+
 #endif
@@ -0,0 +1,6 @@
+// Camera and light, shared by all programs and written once per frame
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    mat4 viewMatrix;
+    vec3 lightPosition;  // In view space
+};
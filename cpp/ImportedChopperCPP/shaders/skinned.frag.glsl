@@ -1,12 +1,18 @@
 #version 400
 
+#include "frame_uniforms.glsl"
+#include "skinned_defaults.glsl"
+
+#if HAS_TEXTURE
 uniform sampler2D texture;
-uniform vec3 lightPosition;
+#endif
 
 in vec3 interpolatedColor;
 in vec3 interpolatedNormal;
 in vec3 interpolatedPosition;
+#if HAS_UV
 in vec2 interpolatedUv;
+#endif
 
 void main(void) {
 
@@ -18,7 +24,11 @@ void main(void) {
     vec3 l = normalize(lightPosition - interpolatedPosition);
     vec3 n = normalize(interpolatedNormal);
 
+#if HAS_TEXTURE
     vec3 color = texture2D(texture, interpolatedUv).rgb;
+#else
+    vec3 color = interpolatedColor;
+#endif
     color = color * (0.2 + max(0.0, dot(n, l)));
 
     gl_FragColor = vec4(color, 1.0);
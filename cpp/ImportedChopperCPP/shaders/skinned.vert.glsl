@@ -1,10 +1,10 @@
 #version 400
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
+#include "frame_uniforms.glsl"
+#include "skinned_defaults.glsl"
+
 uniform mat4 modelMatrix;
-uniform mat4 boneMatrices[57]; //57 bones in the Marine (if one of those bones would happen to fall...)
-uniform vec3 lightPosition;
+uniform mat4 boneMatrices[BONE_COUNT];
 
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
@@ -12,22 +12,25 @@ layout(location = 2) in vec3 color;
 
 layout(location = 3) in ivec4 boneIds;
 layout(location = 4) in vec4 boneWeights;
+#if HAS_UV
 layout(location = 5) in vec2 uv;
+#endif
 
 out vec3 interpolatedPosition;
 out vec3 interpolatedNormal;
 out vec3 interpolatedColor;
+#if HAS_UV
 out vec2 interpolatedUv;
+#endif
 
 void main(void) {
     mat4 modelViewMatrix = viewMatrix * modelMatrix;
 
     vec4 weights = normalize(boneWeights);
     mat4 boneMatrix = mat4(0.0);
-    boneMatrix += weights[0] * boneMatrices[boneIds[0]];
-    boneMatrix += weights[1] * boneMatrices[boneIds[1]];
-    boneMatrix += weights[2] * boneMatrices[boneIds[2]];
-    boneMatrix += weights[3] * boneMatrices[boneIds[3]];
+    for (int i = 0; i < WEIGHTS_PER_VERTEX; i++) { //Unrolled by the compiler, the unused weights are 0 anyway
+        boneMatrix += weights[i] * boneMatrices[boneIds[i]];
+    }
 
     gl_Position = projectionMatrix * modelViewMatrix * boneMatrix * vec4(position, 1.0);
 
@@ -35,5 +38,7 @@ void main(void) {
     interpolatedNormal = normalize(normalMatrix * normal);
 
     interpolatedColor = color;
+#if HAS_UV
     interpolatedUv = uv;
+#endif
 }
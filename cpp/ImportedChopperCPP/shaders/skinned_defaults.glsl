@@ -0,0 +1,14 @@
+// The skinned shader is specialized for each mesh with these, see shader_prog::variant.
+// The defaults fit any mesh, but then most of the work is wasted.
+#ifndef BONE_COUNT
+#define BONE_COUNT 57          //57 bones in the Marine (if one of those bones would happen to fall...)
+#endif
+#ifndef WEIGHTS_PER_VERTEX
+#define WEIGHTS_PER_VERTEX 4   //Bones that can move one vertex, at most the 4 in boneIds
+#endif
+#ifndef HAS_UV
+#define HAS_UV 1
+#endif
+#ifndef HAS_TEXTURE
+#define HAS_TEXTURE HAS_UV     //Texturing needs the UV-s
+#endif
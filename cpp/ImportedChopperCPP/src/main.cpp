@@ -11,6 +11,7 @@
 #include <unistd.h>         // Threading
 #include <stdio.h>          // Input/Output
 #include <iostream>
+#include <sstream>
 #include <GLEW/glew.h>      // OpenGL Extension Wrangler -
 #include <GLFW/glfw3.h>     // Windows and input
 #include <glm/glm.hpp>      // OpenGL math library
@@ -25,7 +26,7 @@
 #include "texture_util.h"
 #include "geometry.h"
 
-#define WEIGHTS_PER_VERT 4
+#define WEIGHTS_PER_VERT 4 //Bone influences stored per vertex (boneIds is an ivec4), the shader uses as many as the mesh needs
 
 //These will hold our hangar
 GLuint leftWallVAO, rightWallVAO, backWallVAO, ceilingVAO, floorVAO;
@@ -87,6 +88,7 @@ struct Object3D {
     std::vector<Object3D> children;
     glm::mat4 rigTransform;
     GLuint textureHandle;
+    shader_prog* shader;    //The shader variant specialized for this object (skinned objects only)
 };
 
 /**
@@ -111,6 +113,20 @@ Object3D marine;
 shader_prog defaultShader("shaders/default.vert.glsl", "shaders/default.frag.glsl");
 shader_prog skinnedShader("shaders/skinned.vert.glsl", "shaders/skinned.frag.glsl");
 
+/**
+ * The FrameUniforms block of the shaders, in std140 layout: camera and light data written once
+ * per frame and read by every program.
+ */
+struct FrameUniforms {
+    glm::mat4 projectionMatrix;
+    glm::mat4 viewMatrix;
+    glm::vec4 lightPosition;  // A vec3 in the block, padded to 16 bytes by std140
+};
+uniform_buffer frameUniforms(0, sizeof(FrameUniforms));
+
+// The modelMatrix of each program, looked up once in main after the programs are linked
+uniform_handle<glm::mat4> defaultModelMatrix, marineModelMatrix;
+
 float screenWidth = 800;
 float screenHeight = 450;
 
@@ -134,7 +150,7 @@ void initHangar() {
 /**
  * Drawing the hangar (each wall).
  */
-void drawHangar(shader_prog* shader) {
+void drawHangar(shader_prog* shader, uniform_handle<glm::mat4>& modelMatrix) {
     shader->activate();
 
     std::stack<glm::mat4> ms;
@@ -148,7 +164,7 @@ void drawHangar(shader_prog* shader) {
         ms.top() = glm::translate(ms.top(), glm::vec3(-10.0, 0.0, 10.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(90.0f), glm::vec3(0.0, 1.0, 0.0));
         ms.top() = glm::scale(ms.top(), glm::vec3(2.0, 1.0, 1.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(leftWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
@@ -156,7 +172,7 @@ void drawHangar(shader_prog* shader) {
         ms.top() = glm::translate(ms.top(), glm::vec3(10.0, 0.0, 10.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(-90.0f), glm::vec3(0.0, 1.0, 0.0));
         ms.top() = glm::scale(ms.top(), glm::vec3(2.0, 1.0, 1.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(rightWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
@@ -164,7 +180,7 @@ void drawHangar(shader_prog* shader) {
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, -10.0, 10.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(-90.0f), glm::vec3(1.0, 0.0, 0.0));
         ms.top() = glm::scale(ms.top(), glm::vec3(1.0, 2.0, 1.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(floorVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
@@ -172,13 +188,13 @@ void drawHangar(shader_prog* shader) {
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, 10.0, 10.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(90.0f), glm::vec3(1.0, 0.0, 0.0));
         ms.top() = glm::scale(ms.top(), glm::vec3(1.0, 2.0, 1.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(ceilingVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, 0.0, -10.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(backWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
@@ -187,7 +203,7 @@ void drawHangar(shader_prog* shader) {
 /**
  * Recursive drawing for object hierarchies.
  */
-void drawObjectRec(Object3D* object, std::stack<glm::mat4>* ms, shader_prog* shader) {
+void drawObjectRec(Object3D* object, std::stack<glm::mat4>* ms, uniform_handle<glm::mat4>& modelMatrix) {
     ms->push(ms->top());
         ms->top() = glm::translate(ms->top(), object->position);
         ms->top() = glm::rotate(ms->top(), object->rotation.x, glm::vec3(1.0, 0.0, 0.0));
@@ -196,7 +212,7 @@ void drawObjectRec(Object3D* object, std::stack<glm::mat4>* ms, shader_prog* sha
         ms->top() = glm::scale(ms->top(), object->scale);
         ms->top() = ms->top() * object->model;
 
-        shader->uniformMatrix4fv("modelMatrix", ms->top());
+        modelMatrix.set(ms->top());
         glBindVertexArray(object->vao);
         glDrawElements(GL_TRIANGLES, object->indexCount, GL_UNSIGNED_INT, 0);
 
@@ -206,7 +222,7 @@ void drawObjectRec(Object3D* object, std::stack<glm::mat4>* ms, shader_prog* sha
         }
 
         for (unsigned int i = 0; i < object->children.size(); i++) {
-            drawObjectRec(&object->children[i], ms, shader);
+            drawObjectRec(&object->children[i], ms, modelMatrix);
         }
     ms->pop();
 }
@@ -214,12 +230,12 @@ void drawObjectRec(Object3D* object, std::stack<glm::mat4>* ms, shader_prog* sha
 /**
  * Draw one Object3D.
  */
-void drawObject(Object3D* object, shader_prog* shader) {
+void drawObject(Object3D* object, shader_prog* shader, uniform_handle<glm::mat4>& modelMatrix) {
     shader->activate();
 
     std::stack<glm::mat4> ms;
     ms.push(glm::mat4(1.0));
-        drawObjectRec(object, &ms, shader);
+        drawObjectRec(object, &ms, modelMatrix);
     ms.pop();
 }
 
@@ -291,6 +307,7 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
         object.rotation = glm::vec3(0.0);
         object.position = glm::vec3(0.0);
         object.scale = glm::vec3(1.0);
+        object.shader = &skinnedShader;
 
         return object;
     }
@@ -317,6 +334,7 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
     std::map<std::string, Bone> bones = std::map<std::string, Bone>();
 
     std::vector<unsigned int> indices = std::vector<unsigned int>();
+    unsigned int maxWeights = 1; //Most bones moving one vertex, at most WEIGHTS_PER_VERT
 
 
     printf("Meshes: %d\n", node->mNumMeshes);
@@ -357,7 +375,6 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
                 printf("Root: %s\n", bone->name.c_str());
             }
         }
-        skinnedShader.uniformVecMat4("boneMatrices", boneMatrices); //Send the bone matrices to skinnedShader
 
         printf("Vertices: %d\n", mesh->mNumVertices);
         aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
@@ -384,6 +401,7 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
             if (boneMap[j].size() > WEIGHTS_PER_VERT) { //This can happen (happens a lot with the Marine)
                 //printf("WARNING, too many bones for one vertes: %d\n", boneMap[j].size());
             }
+            maxWeights = std::max(maxWeights, std::min((unsigned int)boneMap[j].size(), (unsigned int)WEIGHTS_PER_VERT));
 
             //vector of <ID, weight>  - for vertex j
             std::vector<std::pair<int, float> > weights = boneMap[j];
@@ -394,9 +412,6 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
                 if (k < weights.size() && weights[k].second > 0.0) {
                     boneIds.push_back(weights[k].first);        //Assign bone ID
                     boneWeights.push_back(weights[k].second);   //Assign weight for that bone
-                    if (weights[k].first > 56) {
-                        printf("Too large index, not enough matrices! %d", weights[k].first);
-                    }
                 } else {
                     boneIds.push_back(0);
                     boneWeights.push_back(0.0f);
@@ -468,13 +483,24 @@ Object3D initSkinnedObject(const aiScene* scene, char* name) {
         animations.insert(std::make_pair(animation.name, animation));
     }
 
+    //The skinned shader specialized for this mesh: only as many bone matrices and weights as it has
+    std::ostringstream boneCount, weightCount;
+    boneCount << std::max((int)bones.size(), 1);
+    weightCount << maxWeights;
+    shader_defines defines;
+    defines["BONE_COUNT"] = boneCount.str();
+    defines["WEIGHTS_PER_VERTEX"] = weightCount.str();
+    defines["HAS_UV"] = uvs.size() > 0 ? "1" : "0";
+    defines["HAS_TEXTURE"] = object.textureHandle > 0 ? "1" : "0";
+    object.shader = skinnedShader.variant(defines); //Compiles in the background, the attributes below only need its layout locations
+
     if (WEIGHTS_PER_VERT == 4) { //Send the bone ids and weights for vertices
-        skinnedShader.attributeVectorInt("boneIds", boneIds);
-        skinnedShader.attributeVectorFloat("boneWeights", boneWeights);
+        object.shader->attributeVectorInt("boneIds", boneIds);
+        object.shader->attributeVectorFloat("boneWeights", boneWeights);
     }
-    skinnedShader.attributePosColNom(positions, colors, normals, indices); //The usual
+    object.shader->attributePosColNom(positions, colors, normals, indices); //The usual
     if (uvs.size() > 0) { //Also send UV-s
-        skinnedShader.attributeVectorVec2("uv", uvs);
+        object.shader->attributeVectorVec2("uv", uvs);
     }
 
     glBindVertexArray(0);
@@ -746,8 +772,8 @@ void updateMarineAnimation(double dt) {
         boneMatrices.push_back(m);
     }
 
-    skinnedShader.activate(); //Send the updated matrices
-    skinnedShader.uniformVecMat4("boneMatrices", boneMatrices);
+    marine.shader->activate(); //Send the updated matrices
+    marine.shader->uniformVecMat4("boneMatrices", boneMatrices);
 }
 
 /**
@@ -781,10 +807,10 @@ void updateMarinePosition(double dt) {
  * Hangar with the default shader, particles with the particle shader.
  */
 void drawScene() {
-    drawHangar(&defaultShader);
-    drawObject(&chopperOBJ, &defaultShader);
-    drawObject(&chopperCollada, &defaultShader);
-    drawObject(&marine, &skinnedShader);
+    drawHangar(&defaultShader, defaultModelMatrix);
+    drawObject(&chopperOBJ, &defaultShader, defaultModelMatrix);
+    drawObject(&chopperCollada, &defaultShader, defaultModelMatrix);
+    drawObject(&marine, marine.shader, marineModelMatrix);
 }
 
 
@@ -872,10 +898,13 @@ int main(int argc, char *argv[]) {
     glfwSetKeyCallback(win, key_callback);
     initKeyboard();
 
-    defaultShader.use();
-    skinnedShader.use();
+    shader_prog::submitAll({&defaultShader}); // Compiles without waiting, checked when first used. Skinned objects get their own variants of skinnedShader.
 
-    initHangar();
+    // Both shaders read the camera and the light from one buffer
+    frameUniforms.create();
+    defaultShader.uniformBlock("FrameUniforms", frameUniforms);
+    skinnedShader.uniformBlock("FrameUniforms", frameUniforms);
+    FrameUniforms frame;
 
     mainCamera = new Camera(
         glm::perspective(glm::radians(80.0f), screenWidth / screenHeight, 0.1f, 300.f),
@@ -898,6 +927,13 @@ int main(int argc, char *argv[]) {
     DoTheImportThing("data/chopper.obj", *initChopperOBJ, chopperOBJ);         //This is a chopper from Timo Kallaste
     DoTheImportThing("data/chopper.dae", *initChopperCollada, chopperCollada); //You can also try chopper-mat, which is the one Ats did (I added some colors).
     DoTheImportThing("data/marine.fbx", *initMarine, marine);       //Seems that Blender's Collada exporter can only export 1 animation. This is why we use FBX here.
+    if (marine.shader == NULL) marine.shader = &skinnedShader;      //The import failed, there is no variant
+
+    initHangar();   //Waits for the default shader to link, so only after the marine's variant was submitted too
+
+    // The uniforms set every frame, looked up once
+    defaultModelMatrix = defaultShader.uniformHandle<glm::mat4>("modelMatrix");
+    marineModelMatrix = marine.shader->uniformHandle<glm::mat4>("modelMatrix");
 
     double dt = 0.0;             // We need to calculate the deltaTime each frame
     double currentTime = 0.0;    // Othewise we can't change the animation speeds correctly.
@@ -917,15 +953,10 @@ int main(int argc, char *argv[]) {
         lightPosition.y = 7.0f * cos(glfwGetTime());
         lightPosition.z = -20.0f * sin(glfwGetTime()) + 5.0;
 
-        defaultShader.activate(); // Send the updated values to the shaders
-        defaultShader.uniformVec3("lightPosition", glm::vec3(mainCamera->view * glm::vec4(lightPosition, 1.0)));
-        defaultShader.uniformMatrix4fv("projectionMatrix", mainCamera->projection);
-        defaultShader.uniformMatrix4fv("viewMatrix", mainCamera->view);
-
-        skinnedShader.activate();
-        skinnedShader.uniformVec3("lightPosition", glm::vec3(mainCamera->view * glm::vec4(lightPosition, 1.0)));
-        skinnedShader.uniformMatrix4fv("projectionMatrix", mainCamera->projection);
-        skinnedShader.uniformMatrix4fv("viewMatrix", mainCamera->view);
+        frame.projectionMatrix = mainCamera->projection; // Send the updated values to the shaders
+        frame.viewMatrix = mainCamera->view;
+        frame.lightPosition = mainCamera->view * glm::vec4(lightPosition, 1.0);
+        frameUniforms.update(&frame);
 
         /**
          * --Task--
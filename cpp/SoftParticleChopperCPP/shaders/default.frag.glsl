@@ -1,6 +1,6 @@
 #version 400
 
-uniform vec3 lightPosition;
+#include "frame_uniforms.glsl"
 
 in vec3 interpolatedColor;
 in vec3 interpolatedNormal;
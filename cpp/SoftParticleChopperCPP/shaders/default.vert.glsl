@@ -1,9 +1,7 @@
 #version 400
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
+#include "frame_uniforms.glsl"
 uniform mat4 modelMatrix;
-uniform vec3 lightPosition;
 
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 color;
@@ -1,7 +1,6 @@
 #version 400
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
+#include "frame_uniforms.glsl"
 uniform mat4 modelMatrix;
 uniform vec2 frustum;
 
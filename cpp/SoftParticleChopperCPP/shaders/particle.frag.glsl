@@ -1,7 +1,7 @@
 #version 400
 
 uniform vec2 screenSize;
-uniform vec3 lightPosition;
+#include "frame_uniforms.glsl"
 uniform sampler2D texture;
 uniform sampler2D depthTexture;
 
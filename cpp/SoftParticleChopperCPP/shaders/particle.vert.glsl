@@ -1,9 +1,7 @@
 #version 400
 
-uniform mat4 projectionMatrix;
-uniform mat4 viewMatrix;
+#include "frame_uniforms.glsl"
 uniform mat4 modelMatrix;
-uniform vec3 lightPosition;
 uniform vec3 viewerPosition;
 uniform vec2 frustum;
 
@@ -31,6 +31,20 @@ shader_prog defaultShader("shaders/default.vert.glsl", "shaders/default.frag.gls
 shader_prog particleShader("shaders/particle.vert.glsl", "shaders/particle.frag.glsl");
 shader_prog depthShader("shaders/depth.vert.glsl", "shaders/depth.frag.glsl");
 
+/**
+ * The FrameUniforms block of the shaders, in std140 layout: camera and light data written once
+ * per frame and read by every program.
+ */
+struct FrameUniforms {
+    glm::mat4 projectionMatrix;
+    glm::mat4 viewMatrix;
+    glm::vec4 lightPosition;  // A vec3 in the block, padded to 16 bytes by std140
+};
+uniform_buffer frameUniforms(0, sizeof(FrameUniforms));
+
+// The modelMatrix of each program drawing the hangar, looked up once in main after linking
+uniform_handle<glm::mat4> defaultModelMatrix, depthModelMatrix;
+
 float screenWidth = 800;
 float screenHeight = 450;
 
@@ -121,7 +135,7 @@ void initDepthRenderTarget() {
 /**
  * Drawing the hangar (each wall).
  */
-void drawHangar(shader_prog* shader) {
+void drawHangar(shader_prog* shader, uniform_handle<glm::mat4>& modelMatrix) {
     shader->activate();
 
     std::stack<glm::mat4> ms;
@@ -130,34 +144,34 @@ void drawHangar(shader_prog* shader) {
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(-10.0, 0.0, 0.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(90.0f), glm::vec3(0.0, 1.0, 0.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(leftWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(10.0, 0.0, 0.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(-90.0f), glm::vec3(0.0, 1.0, 0.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(leftWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, -10.0, 0.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(-90.0f), glm::vec3(1.0, 0.0, 0.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(floorVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, 10.0, 0.0));
         ms.top() = glm::rotate(ms.top(), glm::radians(90.0f), glm::vec3(1.0, 0.0, 0.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(ceilingVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
     ms.push(ms.top());
         ms.top() = glm::translate(ms.top(), glm::vec3(0.0, 0.0, -10.0));
-        shader->uniformMatrix4fv("modelMatrix", ms.top());
+        modelMatrix.set(ms.top());
         glBindVertexArray(backWallVAO);
         glDrawArrays(GL_TRIANGLES, 0, 6);
     ms.pop();
@@ -202,7 +216,7 @@ void drawParticles(shader_prog* shader) {
  * Hangar with the default shader, particles with the particle shader.
  */
 void drawScene() {
-    drawHangar(&defaultShader);
+    drawHangar(&defaultShader, defaultModelMatrix);
     drawChopper(&defaultShader);
     drawParticles(&particleShader);
 }
@@ -240,10 +254,8 @@ int main(int argc, char *argv[]) {
     printf ("OpenGL version supported %s\n", version);
 
 
-    //We compile all 3 of our shades
-    defaultShader.use();
-    particleShader.use();
-    depthShader.use();
+    //We compile all 3 of our shades at once, each is checked when first used
+    shader_prog::submitAll({&defaultShader, &particleShader, &depthShader});
 
     //We initialize our stuff
     initHangar();
@@ -264,20 +276,20 @@ int main(int argc, char *argv[]) {
         glm::vec3(0.0, 1.0, 0.0)   //Up
     );
 
-    //Send the view and projection matrices to all 3 shaders.
-    defaultShader.activate();
-    defaultShader.uniformMatrix4fv("projectionMatrix", perspective);
-    defaultShader.uniformMatrix4fv("viewMatrix", view);
+    //The view and projection matrices go to all 3 shaders through one buffer.
+    frameUniforms.create();
+    defaultShader.uniformBlock("FrameUniforms", frameUniforms);
+    particleShader.uniformBlock("FrameUniforms", frameUniforms);
+    depthShader.uniformBlock("FrameUniforms", frameUniforms);
+    FrameUniforms frame;
+    frame.projectionMatrix = perspective;
+    frame.viewMatrix = view;
 
     particleShader.activate();
-    particleShader.uniformMatrix4fv("projectionMatrix", perspective);
-    particleShader.uniformMatrix4fv("viewMatrix", view);
     particleShader.uniformVec2("frustum", glm::vec2(near, far));
     particleShader.uniformVec2("screenSize", glm::vec2(screenWidth, screenHeight));
 
     depthShader.activate();
-    depthShader.uniformMatrix4fv("projectionMatrix", perspective);
-    depthShader.uniformMatrix4fv("viewMatrix", view);
     depthShader.uniformVec2("frustum", glm::vec2(near, far));
 
     glm::vec3 lightPosition;
@@ -294,6 +306,11 @@ int main(int argc, char *argv[]) {
 
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+    // The uniforms set every frame, looked up once
+    uniform_handle<int> depthTextureUniform = particleShader.uniformHandle<int>("depthTexture");
+    defaultModelMatrix = defaultShader.uniformHandle<glm::mat4>("modelMatrix");
+    depthModelMatrix = depthShader.uniformHandle<glm::mat4>("modelMatrix");
+
     // -------------- Create objects ------------- //
     printf("Starting rendering loop...");
     while (!glfwWindowShouldClose(win)) {
@@ -302,14 +319,14 @@ int main(int argc, char *argv[]) {
         lightPosition.x = 0.8f * sin(glfwGetTime()); //Move our light on a trajectory
         lightPosition.y = 0.5f * cos(glfwGetTime());
         lightPosition.z = 0.1f * sin(glfwGetTime()) + 0.3;
-        defaultShader.activate();
-        defaultShader.uniformVec3("lightPosition", glm::vec3(view * glm::vec4(lightPosition, 1.0)));
+        frame.lightPosition = view * glm::vec4(lightPosition, 1.0);
+        frameUniforms.update(&frame);
 
         //Set rendering to a texture
         glBindFramebuffer(GL_FRAMEBUFFER, depthFramebuffer);
 
         //Draw the hangar with the depthShader
-        drawHangar(&depthShader);
+        drawHangar(&depthShader, depthModelMatrix);
 
         //Reset to normal rendering
         glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -317,8 +334,8 @@ int main(int argc, char *argv[]) {
         //Activate our previous render target
         particleShader.activate();
 
-        //Get the location for the "depthTexture" variable, bind new data to that location
-        glUniform1i(glGetUniformLocation(particleShader.getProg(), "depthTexture"), 1);
+        //Bind new data to the "depthTexture" variable
+        depthTextureUniform.set(1);
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_2D, depthRenderTarget);
 
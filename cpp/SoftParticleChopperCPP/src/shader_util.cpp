@@ -11,7 +11,15 @@
 #include <vector>
 #include <cstring>
 #include <stdlib.h>
-using std::strcpy;
+#include <stdint.h>
+#include <cctype>
+#include <thread>
+#include <exception>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 
 // -------- Utility functions --------------
 /**
@@ -25,27 +33,83 @@ std::string get_file_contents(const char *filename) {
 }
 
 /**
- * Allocates and compiles given shader in OpenGL
+ * Expands the #include "file" lines of a shader, relative to the including file, and marks each
+ * file with #line so that compile errors point into it. files[n] is the file of source string n.
  */
-GLuint compile(GLuint type, std::string source) {
-    GLuint shader = glCreateShader(type);
+std::string expand_includes(const std::string& source, const std::string& filename, std::vector<std::string>& files, int depth = 0) {
+    if (depth > 16) throw std::runtime_error("Shader includes nested too deep in " + filename);
+    int number = files.size();
+    files.push_back(filename);
+    std::string dir = filename.substr(0, filename.find_last_of("/\\") + 1);
 
-    // Split the code into separate lines (then the compilation error messages are more informative)
-    std::vector<GLchar *> lines;
+    std::ostringstream out;
+    std::istringstream in(source);
     std::string line;
-    std::istringstream ss(source);
-    while(getline(ss, line)) {
-        line += '\n';
-        GLchar* c_line = (GLchar*)malloc(line.size()+1);
-        strcpy(c_line, line.c_str());
-        lines.push_back(c_line);
+    for (int lineNumber = 1; getline(in, line); lineNumber++) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+            out << line << '\n';
+            continue;
+        }
+        size_t open = line.find('"', start + 8);
+        size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+        if (close == std::string::npos) {
+            std::ostringstream error;
+            error << filename << ":" << lineNumber << ": malformed #include";
+            throw std::runtime_error(error.str());
+        }
+        std::string included = dir + line.substr(open + 1, close - open - 1);
+        out << "#line 1 " << files.size() << '\n';
+        out << expand_includes(get_file_contents(included.c_str()), included, files, depth + 1);
+        out << "#line " << lineNumber + 1 << " " << number << '\n';
     }
+    return out.str();
+}
 
-    // Compile the source
-    glShaderSource(shader, lines.size(), (const GLchar**)&lines[0], NULL);
+/**
+ * Names the files in a compile log: the source string number in front of the line number
+ * ("0(12)" or "0:12", depending on the driver) is replaced by files[number].
+ */
+std::string map_log(const std::string& log, const std::vector<std::string>& files) {
+    std::ostringstream out;
+    std::istringstream in(log);
+    std::string line;
+    while (getline(in, line)) {
+        for (size_t i = 0; i < line.size(); i++) {
+            if (!isdigit((unsigned char)line[i])) continue;
+            size_t j = i;
+            while (j < line.size() && isdigit((unsigned char)line[j])) j++;
+            if (j + 1 < line.size() && (line[j] == ':' || line[j] == '(') && isdigit((unsigned char)line[j + 1])) {
+                unsigned int number = atoi(line.substr(i, j - i).c_str());
+                if (number < files.size()) line.replace(i, j - i, files[number]);
+                break;
+            }
+            i = j;
+        }
+        out << line << '\n';
+    }
+    return out.str();
+}
+
+/**
+ * Allocates given shader in OpenGL and starts compiling it. The result is checked with check_compiled.
+ */
+GLuint compile(GLuint type, const std::string& source) {
+    GLuint shader = glCreateShader(type);
+
+    // Compile the source, the driver may do it in the background. It goes as one string, as the
+    // #line directives from expand_includes number the files for the error messages.
+    const GLchar* code = source.c_str();
+    glShaderSource(shader, 1, &code, NULL);
     glCompileShader(shader);
-    for (unsigned int i = 0; i < lines.size(); i++) free(lines[i]);
 
+    return shader;
+}
+
+/**
+ * Waits for the shader to compile, throws the compilation log if it failed.
+ */
+void check_compiled(GLuint shader, const std::vector<std::string>& files) {
     GLint compiled;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
     if (!compiled) {
@@ -53,11 +117,74 @@ GLuint compile(GLuint type, std::string source) {
         glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
         std::string log(length, ' ');
         glGetShaderInfoLog(shader, length, &length, &log[0]);
+        log = map_log(log, files);
         std::cout << "Shader compilation error: " << log << std::endl;
         throw std::logic_error(log);
-        return false;
     }
-    return shader;
+}
+
+/**
+ * Cache file of the program linked from these sources by this driver, or "" if there is no cache.
+ * The name is a hash of the sources and of the GL vendor, renderer and version, so that a driver
+ * update or an edited shader never picks up a stale binary.
+ */
+std::string program_cache_file(const std::string& v_source, const std::string& f_source) {
+    std::string dir = SHADER_CACHE_DIR;
+    GLint formats = 0;
+    if (dir.empty() || !(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)) return "";
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats == 0) return "";
+
+    const char* parts[] = {
+        v_source.c_str(), f_source.c_str(),
+        (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER), (const char*)glGetString(GL_VERSION)
+    };
+    uint64_t hash = 14695981039346656037ULL;  // 64-bit FNV-1a
+    for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        for (const char* c = parts[i]; c != NULL && *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        hash = (hash ^ 0xFF) * 1099511628211ULL;  // Separator, so that moving text between parts changes the hash
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)hash);
+    return dir + name;
+}
+
+/**
+ * Hands a cached binary of the program to the driver. Returns false if there is none. The driver
+ * may still reject it, which shows as a failed link, and the program can then be linked from source.
+ */
+bool load_program_binary(GLuint prog, const std::string& filename) {
+    if (filename.empty()) return false;
+    std::ifstream in(filename.c_str(), std::ios::in | std::ios::binary);
+    GLenum format;
+    if (!in.read((char*)&format, sizeof(format))) return false;
+    std::string binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    glProgramBinary(prog, format, binary.data(), binary.size());
+    return true;
+}
+
+/**
+ * Stores a linked program for load_program_binary on the next run.
+ */
+void save_program_binary(GLuint prog, const std::string& filename) {
+    if (filename.empty()) return;
+    GLint length = 0;
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length == 0) return;
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(prog, length, &length, &format, &binary[0]);
+
+#ifdef _WIN32
+    _mkdir(SHADER_CACHE_DIR);
+#else
+    mkdir(SHADER_CACHE_DIR, 0755);
+#endif
+    std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write((const char*)&format, sizeof(format));
+    out.write(&binary[0], length);
+    if (!out) printf("WARNING: Could not write shader binary %s.\n", filename.c_str());
 }
 
 /**
@@ -78,30 +205,212 @@ const GLchar *default_fragment_shader = // Only supports coloring. Textures requ
     "    gl_FragColor = vertex_color;\n"
     "}";
 
-shader_prog::shader_prog(const char* vertex_shader_filename, const char* fragment_shader_filename) {
-    v_source = vertex_shader_filename == NULL ? std::string((const char*)default_vertex_shader) : get_file_contents(vertex_shader_filename);
-    f_source = fragment_shader_filename == NULL ? std::string((const char*)default_fragment_shader) : get_file_contents(fragment_shader_filename);
+shader_prog::shader_prog(const char* vertex_shader_filename, const char* fragment_shader_filename):
+    vertex_shader(0), fragment_shader(0), prog(0),
+    v_filename(vertex_shader_filename == NULL ? "" : vertex_shader_filename),
+    f_filename(fragment_shader_filename == NULL ? "" : fragment_shader_filename) {
+}
+
+/**
+ * Reads the sources. Needs no GL context, so submitAll runs it on worker threads.
+ */
+void shader_prog::load() {
+    if (loaded) return;
+    v_files.clear();
+    f_files.clear();
+    if (v_filename.empty()) {
+        v_source = default_vertex_shader;
+        v_files.push_back("default vertex shader");
+    } else {
+        v_source = expand_includes(get_file_contents(v_filename.c_str()), v_filename, v_files);
+    }
+    if (f_filename.empty()) {
+        f_source = default_fragment_shader;
+        f_files.push_back("default fragment shader");
+    } else {
+        f_source = expand_includes(get_file_contents(f_filename.c_str()), f_filename, f_files);
+    }
+    loaded = true;
 }
 
 void shader_prog::use() {
+    submit();
+    finish();
+    glUseProgram(prog);
+}
+
+void shader_prog::submitAll(const std::vector<shader_prog*>& programs) {
+    // Read the sources in parallel, handing file errors back to this thread
+    std::vector<std::thread> loaders;
+    std::vector<std::exception_ptr> errors(programs.size());
+    for (size_t i = 0; i < programs.size(); i++) {
+        loaders.push_back(std::thread([&programs, &errors, i]() {
+            try {
+                programs[i]->load();
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }));
+    }
+    for (size_t i = 0; i < loaders.size(); i++) loaders[i].join();
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i]) std::rethrow_exception(errors[i]);
+    }
+
+#ifdef GL_KHR_parallel_shader_compile
+    // Let the driver compile on as many threads as it likes
+    if (GLEW_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    else if (GLEW_ARB_parallel_shader_compile) glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+#endif
+
+    // Everything is submitted before any status is asked, as asking waits for the driver
+    for (size_t i = 0; i < programs.size(); i++) programs[i]->submit();
+}
+
+/**
+ * Starts linking the program, from the binary cache if possible, without waiting for the driver.
+ */
+void shader_prog::submit() {
+    load();
+    cacheFile = program_cache_file(v_source, f_source);
+    vertex_shader = fragment_shader = 0;
+    prog = glCreateProgram();
+    fromBinary = load_program_binary(prog, cacheFile);
+    if (!fromBinary) link();
+    pending = true;
+}
+
+/**
+ * Starts compiling and linking the program from source.
+ */
+void shader_prog::link() {
     vertex_shader = compile(GL_VERTEX_SHADER, v_source);
     fragment_shader = compile(GL_FRAGMENT_SHADER, f_source);
-    prog = glCreateProgram();
     glAttachShader(prog, vertex_shader);
     glAttachShader(prog, fragment_shader);
+    if (!cacheFile.empty()) glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(prog);
-    glUseProgram(prog);
+}
+
+/**
+ * Waits for a submitted program and checks it. A rejected cached binary is replaced by compiling
+ * from source, a program that fails to compile or link throws its log.
+ */
+void shader_prog::finish() {
+    pending = false;
+    GLint isLinked = 0;
+    glGetProgramiv(prog, GL_LINK_STATUS, &isLinked);
+    if (!isLinked && fromBinary) {
+        printf("Cached shader binary %s was rejected, compiling from source.\n", cacheFile.c_str());
+        fromBinary = false;
+        link();
+        glGetProgramiv(prog, GL_LINK_STATUS, &isLinked);
+    }
+    if (!isLinked) {
+        check_compiled(vertex_shader, v_files);
+        check_compiled(fragment_shader, f_files);
+
+        GLint length = 0;
+        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &length);
+        printf("Info log length %d\n", length);
+        std::string log(length, ' ');
+        glGetProgramInfoLog(prog, length, &length, &log[0]);
+        std::cout << "Shader linking error: " << log << std::endl;
+        throw std::logic_error(log);
+        return;
+    }
+    if (!fromBinary) save_program_binary(prog, cacheFile);
+    introspect();
+
+    // Blocks asked for with uniformBlock() before the program was linked
+    for (std::map<std::string, GLuint>::iterator b = blockBindings.begin(); b != blockBindings.end(); b++) {
+        GLuint index = glGetUniformBlockIndex(prog, b->first.c_str());
+        if (index != GL_INVALID_INDEX) glUniformBlockBinding(prog, index, b->second);
+    }
+}
+
+/**
+ * Lists the active uniforms and attributes of the linked program, so that nothing has to be
+ * looked up by name while drawing.
+ */
+void shader_prog::introspect() {
+    uniforms.clear();
+    attributes.clear();
+
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(prog, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(prog, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<GLchar> name(maxLength + 1);
+    for (GLint i = 0; i < count; i++) {
+        shader_variable u;
+        GLsizei length = 0;
+        glGetActiveUniform(prog, i, name.size(), &length, &u.size, &u.type, &name[0]);
+        u.name = std::string(&name[0], length);
+        if (u.name.size() > 3 && u.name.compare(u.name.size() - 3, 3, "[0]") == 0) u.name.erase(u.name.size() - 3);
+        u.location = glGetUniformLocation(prog, u.name.c_str());  // -1 for members of uniform blocks
+        uniforms[u.name] = u;
+    }
+
+    glGetProgramiv(prog, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(prog, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    name.resize(maxLength + 1);
+    for (GLint i = 0; i < count; i++) {
+        shader_variable a;
+        GLsizei length = 0;
+        glGetActiveAttrib(prog, i, name.size(), &length, &a.size, &a.type, &name[0]);
+        a.name = std::string(&name[0], length);
+        a.location = glGetAttribLocation(prog, a.name.c_str());
+        attributes[a.name] = a;
+    }
+}
+
+shader_variable* shader_prog::findUniform(const char* name) {
+    if (pending) finish();
+    std::map<std::string, shader_variable>::iterator u = uniforms.find(name);
+    if (u == uniforms.end() || u->second.location < 0) {
+        printf("WARNING: Location not found in shader program for variable %s.\n", name);
+        return NULL;
+    }
+    return &u->second;
+}
+
+/**
+ * Points the program's uniform block at the binding of a shared buffer. A program not linked yet
+ * only records it, so that this never waits for the driver.
+ */
+void shader_prog::uniformBlock(const char* name, const uniform_buffer& buffer) {
+    blockBindings[name] = buffer.getBinding();
+    if (prog == 0 || pending) return;  // Bound by finish() once the program is linked
+    GLuint index = glGetUniformBlockIndex(prog, name);
+    if (index == GL_INVALID_INDEX) {
+        printf("WARNING: Uniform block %s not found in shader program.\n", name);
+        return;
+    }
+    glUniformBlockBinding(prog, index, buffer.getBinding());
+}
+
+GLint shader_prog::attributeLocation(const char* name) {
+    if (pending) finish();
+    std::map<std::string, shader_variable>::iterator a = attributes.find(name);
+    if (a == attributes.end()) {
+        printf("WARNING: Location not found in shader program for variable %s.\n", name);
+        return -1;
+    }
+    return a->second.location;
 }
 
 void shader_prog::activate() {
+    if (pending) finish();
     glUseProgram(prog);
 }
 
 void shader_prog::free() {
+    pending = false;
     glDeleteProgram(prog);
     glDeleteShader(vertex_shader);
     glDeleteShader(fragment_shader);
     glUseProgram(0);
+    prog = vertex_shader = fragment_shader = 0;
 }
 
 shader_prog::operator GLuint() {
@@ -109,45 +418,36 @@ shader_prog::operator GLuint() {
 }
 
 void shader_prog::uniform1i(const char* name, int i) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform1i(loc, i);
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, i);
 }
 void shader_prog::uniform1f(const char* name, float f) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform1f(loc, f);
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, f);
 }
 void shader_prog::uniform3f(const char* name, float x, float y, float z) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform3f(loc, x, y, z);
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, glm::vec3(x, y, z));
 }
 void shader_prog::uniformMatrix4fv(const char* name, const float* matrix) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniformMatrix4fv(loc, 1, GL_FALSE, matrix);
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, glm::make_mat4(matrix));
 }
 void shader_prog::uniformMatrix4fv(const char* name, glm::mat4 matrix) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(matrix));
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, matrix);
 }
 void shader_prog::uniformVec2(const char* name, glm::vec2 v) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform2fv(loc, 1, glm::value_ptr(v));
-
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, v);
 }
 void shader_prog::uniformVec3(const char* name, glm::vec3 v) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform3fv(loc, 1, glm::value_ptr(v));
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, v);
 }
 void shader_prog::uniformTex2D(const char* name, GLuint texturePointer) {
-    GLint loc = glGetUniformLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
-    glUniform1i(loc, textureCounter);
+    shader_variable* u = findUniform(name);
+    if (u) set_uniform(*u, textureCounter);
     glActiveTexture(GL_TEXTURE0 + textureCounter);
     glBindTexture(GL_TEXTURE_2D, texturePointer);
     textureCounter++;
@@ -159,8 +459,7 @@ void shader_prog::attribute3fv(const char* name, GLfloat* vecArray, int numberOf
     glBindBuffer(GL_ARRAY_BUFFER, vboHandle);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*numberOfVertices, vecArray, GL_STATIC_DRAW);
 
-    GLuint loc = glGetAttribLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
+    GLuint loc = attributeLocation(name);
     glEnableVertexAttribArray(loc);
 
     //printf("Enabled location: %d\n", loc);
@@ -180,8 +479,7 @@ GLuint shader_prog::attributeVectorVec3(const char* name, std::vector<glm::vec3>
     glBindBuffer(GL_ARRAY_BUFFER, vboHandle);
     glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*vectorVec3.size()*3, &vectorVec3[0], GL_STATIC_DRAW);
 
-    GLuint loc = glGetAttribLocation(prog, name);
-    if (loc < 0) printf("WARNING: Location not found in shader program for variable %s.\n", name);
+    GLuint loc = attributeLocation(name);
     glEnableVertexAttribArray(loc);
 
     std::cout << name << ": " << loc << std::endl;
@@ -197,3 +495,26 @@ GLuint shader_prog::attributeVectorVec3(const char* name, std::vector<glm::vec3>
 
     return vboHandle;
 }
+
+// -------- Uniform buffers --------------
+uniform_buffer::uniform_buffer(GLuint binding, GLsizeiptr size): buffer(0), binding(binding), size(size) {
+}
+
+void uniform_buffer::create() {
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void uniform_buffer::update(const void* data) {
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void uniform_buffer::free() {
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+}